@@ -1,856 +1,6949 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <ctype.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/syscall.h>
+#include <dirent.h>
+#include <limits.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+// Where a failed compilation reports to. fail() records the message and
+// jumps back to the point that started the work, which cleans up and returns
+// the error to its caller; nothing in the compiler exits the process.
+// fail_at() does the same for an error in the program being compiled, which
+// has a place in the input and may be recovered from to find the next one.
+typedef struct ErrorState
+{
+    jmp_buf jump;
+    char message[256];
+    size_t offset; // Position in the input the error is about, SIZE_MAX for none
+} ErrorState;
 
 // Token types
 enum TokenType
 {
     TOK_INT, TOK_IDENTIFIER, TOK_RETURN, TOK_NUMBER, TOK_SEMICOLON,
-    TOK_LBRACE, TOK_RBRACE, TOK_LPAREN, TOK_RPAREN, TOK_EQUAL, TOK_EOF, TOK_UNKNOWN
+    TOK_LBRACE, TOK_RBRACE, TOK_LPAREN, TOK_RPAREN, TOK_EQUAL, TOK_EOF, TOK_UNKNOWN,
+    TOK_VOID, TOK_IF, TOK_WHILE, TOK_FOR, TOK_CHAR, TOK_LONG
+};
+
+// What syntax errors call the token expected
+static const char* const token_names[] =
+{
+    "'int'", "identifier", "'return'", "number", "';'",
+    "'{'", "'}'", "'('", "')'", "'='", "end of input", "unknown character",
+    "'void'", "'if'", "'while'", "'for'", "'char'", "'long'"
 };
 
-// Token structure
+// Token structure: the lexeme is a span of the input buffer, nothing is copied
 typedef struct Token
 {
     enum TokenType type;
-    char* value;
+    unsigned int length; // Length of the lexeme in bytes
+    size_t start;        // Offset of the lexeme in input
+    uint32_t name;       // Interned name of a TOK_IDENTIFIER
 } Token;
 
+// Character classes for the lexer. A fixed table instead of <ctype.h> keeps
+// classification locale-independent and costs one load per byte.
+#define CC_SPACE 0x01
+#define CC_DIGIT 0x02
+#define CC_ALPHA 0x04 // Letters and '_', anything that may start an identifier
+#define CC_IDENT (CC_ALPHA | CC_DIGIT)
+
+static const unsigned char char_class[256] =
+{
+    [' '] = CC_SPACE, ['\t'] = CC_SPACE, ['\n'] = CC_SPACE,
+    ['\v'] = CC_SPACE, ['\f'] = CC_SPACE, ['\r'] = CC_SPACE,
+    ['0' ... '9'] = CC_DIGIT,
+    ['a' ... 'z'] = CC_ALPHA, ['A' ... 'Z'] = CC_ALPHA, ['_'] = CC_ALPHA,
+};
+
+// Keywords are found with a perfect hash over the first two characters and the
+// length of a scanned identifier, so lookup cost does not grow with the table.
+// A new keyword that collides shows up as an overridden initializer warning;
+// grow KEYWORD_TABLE_SIZE or change the hash when that happens.
+#define KEYWORD_TABLE_SIZE 32
+#define KEYWORD_HASH(c0, c1, len) ((unsigned)((unsigned char)(c0) ^ (unsigned char)(c1) ^ (len)) & (KEYWORD_TABLE_SIZE - 1))
+
+typedef struct Keyword
+{
+    const char* name;
+    unsigned int length;
+    enum TokenType type;
+} Keyword;
+
+// String literal elements are not constant expressions, so the two hashed
+// characters are spelled out next to each keyword
+#define KEYWORD(c0, c1, str, tok) [KEYWORD_HASH(c0, c1, sizeof(str) - 1)] = {str, sizeof(str) - 1, tok}
+
+static const Keyword keyword_table[KEYWORD_TABLE_SIZE] =
+{
+    KEYWORD('i', 'n', "int", TOK_INT),
+    KEYWORD('r', 'e', "return", TOK_RETURN),
+    KEYWORD('v', 'o', "void", TOK_VOID),
+    KEYWORD('i', 'f', "if", TOK_IF),
+    KEYWORD('w', 'h', "while", TOK_WHILE),
+    KEYWORD('f', 'o', "for", TOK_FOR),
+    KEYWORD('c', 'h', "char", TOK_CHAR),
+    KEYWORD('l', 'o', "long", TOK_LONG),
+};
+
 // Node types for AST
 enum NodeType
 {
-    NODE_PROGRAM, NODE_FUNCTION, NODE_CALL, NODE_STMT_LIST, NODE_RETURN,
-    NODE_NUMBER, NODE_VAR_DECL, NODE_VAR_ASSIGN, NODE_VAR_REF
+    NODE_CALL, NODE_RETURN, NODE_NUMBER, NODE_VAR_DECL, NODE_VAR_ASSIGN, NODE_VAR_REF
 };
 
+// Region allocator block; data is carved out front to back
+typedef struct ArenaBlock
+{
+    struct ArenaBlock* next; // Previously filled block
+    size_t used;
+    size_t capacity;
+    _Alignas(16) char data[];
+} ArenaBlock;
+
+typedef struct Arena
+{
+    ArenaBlock* head; // Block currently being filled
+} Arena;
+
+#define ARENA_ALIGNMENT 16
+#define ARENA_BLOCK_SIZE (64 * 1024)
+#define ARENA_MAX_BLOCK_SIZE (16 * 1024 * 1024)
+
+// Interned names: every distinct identifier is stored once and referred to by
+// a small integer id, so names compare and hash as integers. Ids are dense,
+// so tables with an entry per name are indexed by id directly.
+typedef struct InternTable
+{
+    uint32_t* slots;     // Open-addressed ids, 0 for an empty slot; capacity is a power of two
+    size_t slot_capacity;
+    const char** text;   // Indexed by id
+    uint32_t* hashes;
+    uint32_t* lengths;
+    size_t count;        // Ids issued so far, including NAME_NONE
+    size_t capacity;
+    Arena storage;       // Name text
+    uint64_t lookups;    // Counted for --stats
+    uint64_t probes;
+    ErrorState* errors;
+} InternTable;
+
+#define NAME_NONE 0
+#define INTERN_INITIAL_CAPACITY 256
+
 // Symbol table entry
 typedef struct Symbol
 {
-    char* name;
-    int stack_offset; // Offset from rbp (in bytes)
+    uint32_t name;    // Interned name, NAME_NONE for an empty slot
+    int stack_offset; // Offset from rbp (in bytes), -O0
+    uint32_t vreg;    // Virtual register holding the variable, -O1 and up
 } Symbol;
 
+// Block scope: an open-addressed hash table of its own variables
 typedef struct Scope
 {
-    Symbol* symbols;
+    struct Scope* parent; // Enclosing scope, NULL for a function's outermost one
+    Symbol* symbols;      // Capacity is a power of two
     size_t symbol_count;
-    int stack_size; // Total stack size for variables
+    size_t capacity;
 } Scope;
 
-// AST node structure
+#define SCOPE_INITIAL_CAPACITY 16
+
+#define NODE_NONE UINT32_MAX // Absent child
+
+// AST node: a type tag plus the payload of that kind. Children are indices
+// into Ast.nodes rather than pointers, so the tree lives in one array.
 typedef struct Node
 {
     enum NodeType type;
-    char* func_name;    // For function nodes
-    char* var_name;     // For variable nodes
-    int value;          // For number nodes
-    struct Node* body;  // For function nodes
-    struct Node* left;  // For return nodes
-    struct Node* right; // For assign nodes
-    struct Node* next;  // For program node to link functions
+    uint32_t child;       // Return value, initializer (or NODE_NONE) or assigned value
+    union
+    {
+        int value;        // For number nodes
+        uint32_t name;    // Callee for call nodes, variable for the others
+    };
+    uint32_t offset;      // Of the first token in the input, or NODE_NO_OFFSET past 4 GiB
 } Node;
 
-// Global variables
-char* input;            // Input C code
-size_t input_size;
-size_t pos;             // Current position in input
-Token* tokens;          // Array of tokens
-size_t token_count;
-size_t token_pos;       // Current token position
-FILE* output;           // Output assembly file
-Scope* current_scope;
+#define NODE_NO_OFFSET UINT32_MAX
+
+// Function: its body is the statement range [first_stmt, first_stmt + stmt_count) of Ast.nodes
+typedef struct Function
+{
+    uint64_t fingerprint; // Hash of the source text, when compiling incrementally
+    uint32_t name;
+    uint32_t first_stmt;
+    uint32_t stmt_count;
+    uint32_t fragment;    // Code reused from the previous compilation instead of the body, or FRAGMENT_NONE
+    uint32_t offset;      // Of the first token in the input, or NODE_NO_OFFSET past 4 GiB
+} Function;
+
+// Program: functions in source order over one contiguous node array
+typedef struct Ast
+{
+    Node* nodes;
+    size_t node_count;
+    size_t node_capacity;
+    Function* functions;
+    size_t function_count;
+    size_t function_capacity;
+    Node* pending;        // Statements of the lists being parsed, see parse_stmt_list(ctx)
+    size_t pending_count;
+    size_t pending_capacity;
+    ErrorState* errors;
+} Ast;
+
+// x86-64 general purpose registers, numbered as in instruction encodings
+enum Register
+{
+    REG_RAX, REG_RCX, REG_RDX, REG_RBX, REG_RSP, REG_RBP, REG_RSI, REG_RDI,
+    REG_R8, REG_R9, REG_R10, REG_R11, REG_R12, REG_R13, REG_R14, REG_R15,
+    REG_COUNT
+};
+
+static const char register_names[][4] =
+{
+    "rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi",
+    "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15"
+};
+
+// Low 32 bits of each register, written by the shorter instruction forms
+static const char register_names32[][5] =
+{
+    "eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi",
+    "r8d", "r9d", "r10d", "r11d", "r12d", "r13d", "r14d", "r15d"
+};
+
+// Assembly output buffer. Text is appended by the emit_* routines without any
+// printf-style formatting and written out in large chunks.
+typedef struct Emitter
+{
+    char* data;
+    size_t length;
+    size_t capacity;
+    FILE* file;  // Destination of emit_flush(), NULL to only collect in memory
+    const InternTable* names; // Spelling of label names
+    ErrorState* errors;
+} Emitter;
+
+#define EMITTER_INITIAL_CAPACITY (64 * 1024)
+#define EMITTER_FLUSH_SIZE (1024 * 1024)
+
+// Append a string literal without measuring it at run time
+#define EMIT_LITERAL(e, text) emit_text((e), (text), sizeof(text) - 1)
+
+// Machine instructions produced by the code generator. The list is either
+// printed as fasm source or encoded directly into an executable.
+enum Opcode
+{
+    OP_LABEL,   // name:
+    OP_PUSH,    // push dst
+    OP_POP,     // pop dst
+    OP_MOV,     // mov dst, src
+    OP_MOV_IMM, // mov dst, imm
+    OP_LOAD,    // mov dst, [rbp - imm]
+    OP_STORE,   // mov [rbp - imm], src
+    OP_SUB_IMM, // sub dst, imm
+    OP_ADD_IMM, // add dst, imm
+    OP_CALL,    // call name
+    OP_RET,
+    OP_SYSCALL,
+    OP_MOV_IMM32, // mov dst32, imm (zero-extended, imm >= 0)
+    OP_XOR32,     // xor dst32, dst32
+    OP_LEAVE,
+    OP_LOAD32,    // mov dst32, [rbp - imm]
+    OP_STORE32,   // mov [rbp - imm], src32
+    OP_COUNT
+};
+
+typedef struct Inst
+{
+    uint8_t op;   // enum Opcode
+    uint8_t dst;  // enum Register
+    uint8_t src;  // enum Register
+    int imm;      // Immediate, or the rbp displacement of a local
+    uint32_t name;
+} Inst;
+
+typedef struct Code
+{
+    Inst* insts;
+    size_t count;
+    size_t capacity;
+} Code;
+
+// rel32 operand of a call, patched once every label is placed
+typedef struct Fixup
+{
+    size_t offset;
+    uint32_t name;
+} Fixup;
+
+// Incremental compilation keeps the instructions generated for each function
+// in <output>.fragments, keyed by a fingerprint of the function's source text.
+// A file is a FragmentHeader, then name_count names, each a uint32_t length
+// and its text, then fragment_count fragments, each a uint64_t fingerprint, a
+// uint32_t instruction count and that many FragmentInst records.
+#define FRAGMENT_MAGIC "CHEMFRG1"
+#define FRAGMENT_NONE UINT32_MAX
+
+typedef struct FragmentHeader
+{
+    char magic[8]; // FRAGMENT_MAGIC
+    uint64_t seed; // Compiler version and options the fragments were generated with
+    uint32_t name_count;
+    uint32_t fragment_count;
+} FragmentHeader;
+
+// An Inst as stored, with its name an index into the file's names
+typedef struct FragmentInst
+{
+    uint8_t op;
+    uint8_t dst;
+    uint8_t src;
+    uint8_t unused;
+    int32_t imm;
+    uint32_t name;
+} FragmentInst;
+
+typedef struct Fragment
+{
+    uint64_t fingerprint;
+    const char* insts; // FragmentInst records in the loaded file, unaligned
+    uint32_t count;
+} Fragment;
+
+// The fragments of the previous compilation, and the file for the next
+typedef struct FragmentTable
+{
+    char* path;           // <output>.fragments
+    char* data;           // Contents of the loaded file
+    size_t data_capacity;
+    Fragment* fragments;
+    size_t count;
+    size_t capacity;
+    uint32_t* slots;      // Open addressing by fingerprint, fragment index + 1 or 0
+    size_t slot_capacity;
+    size_t slot_mask;
+    uint32_t* names;      // Name ids of the file's names
+    size_t name_capacity;
+    uint32_t* file_names; // File name index + 1 of each name id when saving, 0 if unused
+    size_t file_name_capacity;
+    Emitter file;         // File being written
+    uint64_t seed;
+    int enabled;          // Functions are fingerprinted in this compilation
+} FragmentTable;
+
+// What the optimizer knows about a local variable at the current statement
+typedef struct VarFact
+{
+    uint32_t epoch; // Function the fact belongs to, 0 for none
+    int known;      // Forward walk: holds value
+    int value;
+    int live;       // Backward walk: read before being stored again
+    int referenced; // Backward walk: mentioned at all
+} VarFact;
+
+#define FUNCTION_NONE UINT32_MAX           // Name of no function
+#define FUNCTION_DUPLICATE (UINT32_MAX - 1) // Name of several functions, never inlined
+#define INLINE_MAX_STMTS 8                  // Largest callee body inlined
+
+// Per-function progress of the optimizer's call graph walk
+enum FunctionState
+{
+    FUNC_UNVISITED,
+    FUNC_ACTIVE, // On the walk's stack
+    FUNC_DONE
+};
+
+typedef struct CallFrame
+{
+    uint32_t func;
+    uint32_t next; // Next statement to look for calls in
+} CallFrame;
+
+typedef struct Optimizer
+{
+    VarFact* facts;        // Indexed by name
+    uint32_t* function_of; // Function index by name
+    uint8_t* state;        // enum FunctionState, by function
+    uint8_t* inlinable;    // By function, set once it is done
+} Optimizer;
+
+// Straight-line IR the register allocator works on. Operands are virtual
+// registers, one per variable and one per intermediate value.
+enum IrOp
+{
+    IR_CONST, // dst = imm
+    IR_COPY,  // dst = src
+    IR_CALL,  // call name, dst = result (VREG_NONE to discard it)
+    IR_RET    // return src
+};
+
+typedef struct IrInst
+{
+    uint8_t op; // enum IrOp
+    uint32_t dst;
+    uint32_t src;
+    int imm;
+    uint32_t name;
+} IrInst;
+
+#define VREG_NONE UINT32_MAX
+
+// Where an interval ends up: a register from enum Register, or one of these
+#define REG_NONE -1
+#define LOC_SPILLED -2 // In stack slot Interval.slot for its whole lifetime
+#define LOC_DEAD -3    // Never read, so definitions are dropped
+
+// Live range of a virtual register over IR positions
+typedef struct Interval
+{
+    uint32_t vreg;
+    uint32_t start;
+    uint32_t end;
+    int used;         // Read at least once
+    int crosses_call; // A call lies strictly inside the range
+    int hint;         // Preferred register, REG_NONE for no preference
+    int location;
+    int slot;
+} Interval;
+
+typedef struct Ir
+{
+    IrInst* insts;
+    size_t count;
+    size_t capacity;
+    Interval* intervals; // Indexed by virtual register
+    size_t vreg_count;
+    size_t vreg_capacity;
+} Ir;
+
+// Frame requirements of one allocated function
+typedef struct RegAlloc
+{
+    int spill_slots;
+    int has_calls;
+    int padding;       // Extra rsp adjustment keeping calls 16-byte aligned
+    uint32_t saved_mask;
+    uint8_t saved[REG_COUNT]; // Callee-saved registers to preserve, in push order
+    int saved_count;
+} RegAlloc;
+
+// Registers handed out by the allocator, caller-saved first so that values not
+// live across a call stay out of the callee-saved ones. r11 is kept free as the
+// scratch register for spilled values.
+static const uint8_t allocation_order[] =
+{
+    REG_RAX, REG_RCX, REG_RDX, REG_RSI, REG_RDI, REG_R8, REG_R9, REG_R10,
+    REG_RBX, REG_R12, REG_R13, REG_R14, REG_R15
+};
+
+#define REG_SCRATCH REG_R11
+
+// A function whose code could not be generated, and why
+typedef struct CodegenFailure
+{
+    uint32_t function; // Index in Ast.functions
+    size_t offset;     // Where in the input, SIZE_MAX if unknown
+    char message[sizeof(((ErrorState*)0)->message)];
+} CodegenFailure;
+
+// A complete event of a --trace file: a phase or the code generation of one
+// function, on the thread that did it
+typedef struct TraceEvent
+{
+    const char* name;      // Phase or function name
+    const char* category;
+    uint32_t thread;
+    uint64_t start_ns;     // CLOCK_MONOTONIC
+    uint64_t duration_ns;
+    uint64_t instructions; // Generated for a function
+} TraceEvent;
+
+// Events recorded by one thread until they are written
+typedef struct TraceBuffer
+{
+    TraceEvent* events;
+    size_t count;
+    size_t capacity;
+    uint32_t thread; // Kernel thread id of the recording thread
+} TraceBuffer;
+
+// The --trace file, in the Chrome Trace Event array format, which stays
+// readable without its closing ']' should the process never get to write it.
+// Every context of the process writes its events there after each
+// compilation.
+typedef struct Trace
+{
+    FILE* file;
+    pthread_mutex_t lock;
+    int empty;         // No event written yet
+    uint64_t start_ns; // Event times are relative to this
+} Trace;
+
+// -O0 stack slot of a variable of the function being generated
+typedef struct FrameVar
+{
+    uint32_t epoch;    // Function the entry belongs to, 0 for none
+    uint32_t last_use; // Last statement mentioning the variable
+    int slot;          // Slot n is the 4 bytes at [rbp - 4n], 0 for none
+} FrameVar;
+
+// -O0 frame of the function being generated, where variables whose lifetimes
+// do not overlap share a slot
+typedef struct Frame
+{
+    FrameVar* vars;      // Indexed by name
+    size_t var_capacity;
+    int* free_slots;     // Of the variables no longer live, the last freed on top
+    size_t free_count;
+    size_t free_capacity;
+    uint32_t epoch;      // Of the function being laid out
+} Frame;
+
+// Code generation state. Each thread generating code has its own.
+typedef struct CodeGen
+{
+    Code* code;   // Where instructions are appended
+    Scope* scope; // Innermost scope of the function being generated
+    Ir ir;        // IR of that function, reused from one function to the next
+    Frame frame;  // Frame of that function at -O0, likewise
+    const InternTable* names;
+    const FragmentTable* fragments;
+    int opt_level;
+    uint64_t scope_lookups;   // Counted for --stats
+    size_t symbol_bytes;      // Held by the open scopes
+    size_t peak_symbol_bytes;
+    TraceBuffer* trace;       // Where function events are recorded, NULL when not tracing
+    CodegenFailure* failures; // In the order the functions were generated
+    size_t failure_count;
+    size_t failure_capacity;
+    ErrorState* errors;
+} CodeGen;
+
+// Functions one code generation thread claims at a time
+#define CODEGEN_BATCH_SIZE 256
+
+typedef struct CodegenJob
+{
+    const Ast* ast;
+    Code* batches; // Instructions of each batch of functions
+    size_t batch_count;
+    size_t next_batch; // First batch nobody has claimed, advanced atomically
+    pthread_mutex_t error_lock;
+    size_t error_batch; // Lowest batch that failed, SIZE_MAX if none
+    char error[sizeof(((ErrorState*)0)->message)];
+} CodegenJob;
+
+// One code generation thread; the first is the calling thread itself
+typedef struct CodegenWorker
+{
+    CodegenJob* job;
+    CodeGen cg;
+    TraceBuffer trace;
+    ErrorState errors;
+    pthread_t thread;
+    uint64_t cpu_ns;
+} CodegenWorker;
+
+// Executable layout, matching what fasm produces for "format ELF64 executable"
+#define ELF_BASE_ADDRESS 0x400000
+#define ELF_HEADER_SIZE 64
+#define ELF_PROGRAM_HEADER_SIZE 56
+#define ELF_CODE_OFFSET (ELF_HEADER_SIZE + 2 * ELF_PROGRAM_HEADER_SIZE)
+#define ELF_SEGMENT_ALIGN 0x1000
+
+// Streaming lexer lookahead window; a power of two larger than the parser's peek distance
+#define TOKEN_RING_SIZE 4
+
+// A thread of the front end's run_workers(), the first member of each item
+// it runs a worker on
+typedef struct WorkerThread
+{
+    pthread_t thread;
+    int started;     // Run on a thread of its own rather than the caller's
+    uint64_t cpu_ns; // Of the worker, whichever thread ran it
+} WorkerThread;
+
+// Inputs of at least two chunks of this size are lexed on several threads
+#define LEX_CHUNK_MIN_SIZE (1 << 20)
+
+// A stretch of the input lexed on a thread of its own. Chunks start and end
+// at token boundaries, so each lexes exactly as it would within the whole
+// input. The first chunk lexes straight into the context's token array and
+// name table; the others intern names in a table of their own, and their
+// names are given their ids in the context's table when the chunks are
+// stitched together.
+typedef struct LexChunk
+{
+    WorkerThread worker;
+    const char* input;
+    size_t start;         // Chunk is input[start, end)
+    size_t end;
+    Token* tokens;
+    size_t token_count;
+    size_t token_capacity;
+    InternTable* table;   // Where the chunk's names are interned: names, or the context's
+    InternTable names;
+    uint32_t* ids;        // Context id of each of the chunk's names
+    size_t id_capacity;
+    Token* out;           // Where the chunk's tokens go in the context's array
+    int tracing;
+    TraceBuffer trace;
+    ErrorState errors;
+    int failed;
+} LexChunk;
+
+// What to produce; fixed for the lifetime of a CompilerContext
+typedef struct CompileOptions
+{
+    int streaming; // Lex on demand through token_ring instead of tokenizing up front
+    int emit_asm;  // Also write <output>.asm
+    int use_fasm;  // Assemble <output>.asm with fasm instead of encoding directly
+    int opt_level; // -O level: 0 keeps every variable on the stack, 1 and up optimize
+    int threads;   // Threads lexing, parsing and generating code
+    int incremental; // Reuse the code of functions unchanged since the last compilation
+    const char* cache_dir; // Directory of cached outputs, NULL for no cache
+    uint64_t cache_limit;  // Bytes the cache may hold before old entries are evicted
+    Trace* trace;          // Where events are written, NULL when not tracing
+} CompileOptions;
+
+// Compilation phases, timed for --stats
+enum Phase
+{
+    PHASE_READ,
+    PHASE_CACHE,     // Looking up and storing cached outputs
+    PHASE_LEX,       // Included in PHASE_PARSE when streaming
+    PHASE_FRAGMENTS, // Loading and saving incremental state
+    PHASE_PARSE,
+    PHASE_OPTIMIZE,
+    PHASE_CODEGEN,
+    PHASE_PEEPHOLE,
+    PHASE_OUTPUT,    // Printing assembly and encoding the executable
+    PHASE_FASM,
+    PHASE_COUNT
+};
+
+static const char* const phase_names[PHASE_COUNT] =
+{
+    "read", "cache", "lex", "fragments", "parse", "optimize", "codegen", "peephole", "output", "fasm"
+};
+
+typedef struct PhaseTime
+{
+    uint64_t wall_ns;
+    uint64_t cpu_ns; // Of every thread working on the phase
+} PhaseTime;
+
+// What one compilation did, as reported by --stats
+typedef struct CompileStats
+{
+    PhaseTime phases[PHASE_COUNT];
+    int cached;                // The outputs came from the cache
+    uint64_t input_bytes;
+    uint64_t tokens;
+    uint64_t nodes;
+    uint64_t functions;
+    uint64_t reused_functions; // Spliced in from the fragment file
+    uint64_t unused_functions; // Never called from main, so not generated
+    uint64_t instructions;
+    uint64_t executable_bytes; // Encoded by the built-in encoder
+    uint64_t name_lookups;     // intern() calls
+    uint64_t name_probes;      // Slots they inspected
+    uint64_t scope_lookups;    // Variable lookups during code generation
+    // Peak bytes held, by what they hold
+    uint64_t token_bytes;
+    uint64_t ast_bytes;
+    uint64_t symbol_bytes;     // Interned names and scopes at their largest
+    uint64_t code_bytes;       // Instructions and IR
+    uint64_t output_bytes;     // Emitter buffers and encoder tables
+} CompileStats;
+
+enum StatsFormat
+{
+    STATS_NONE,
+    STATS_TEXT,
+    STATS_JSON // One object per line and input
+};
+
+// At most this many errors are reported for one input
+#define DIAGNOSTICS_MAX 100
+
+// The errors a compilation found in its input, formatted for the user
+typedef struct Diagnostics
+{
+    char* text;          // One "<input>:<line>:<column>: error: <message>" line per error
+    size_t length;
+    size_t capacity;
+    size_t count;
+    int complete;        // Every error found is in the report
+    const char* input;   // Name of the input in the report
+    size_t* lines;       // Offset of each line of the input, built for the first error
+    size_t line_count;
+    size_t line_capacity;
+} Diagnostics;
+
+// Everything one compilation works on. Contexts share nothing, so separate
+// threads can each drive their own; the arrays are kept from one compilation
+// to the next so that a long-lived context stops allocating.
+typedef struct CompilerContext
+{
+    CompileOptions options;
+    const char* input;    // Input C code, always followed by a '\0' sentinel
+    size_t input_size;
+    size_t input_mapping; // Length of the mmap'd input region, 0 when input is on the heap
+    size_t pos;           // Current position in input
+    Token* tokens;        // Array of tokens
+    size_t token_count;   // Tokens in the array, or tokens lexed so far when streaming
+    size_t token_capacity;
+    size_t token_pos;     // Current token position
+    Token token_ring[TOKEN_RING_SIZE];
+    int token_stream;     // Tokens are lexed on demand through token_ring
+    LexChunk* lex_chunks; // Parallel lexing state, kept like the token array
+    size_t lex_chunk_capacity;
+    struct ParseRange* parse_ranges; // Parallel parsing state, kept likewise
+    size_t parse_range_capacity;
+    InternTable names;    // Identifiers seen by the lexer
+    Ast ast;              // Parsed program
+    Code code;            // Generated instructions
+    FragmentTable fragments; // Code of the previous compilation, when incremental
+    CodeGen codegen;      // Serial code generation state
+    Emitter output;       // Output assembly file
+    Emitter image;        // Executable being encoded
+    int input_fd;         // Input file while it is being read, -1 otherwise
+    size_t* label_offsets; // Encoder scratch, see encode_code()
+    size_t label_capacity;
+    Fixup* fixups;
+    size_t fixup_capacity;
+    char* asm_path;       // "fasm <output>.asm", the path starting after "fasm "
+    char* cache_buffer;   // Cache entry being read or written
+    size_t cache_length;
+    size_t cache_capacity;
+    int cache_stored;     // Set once this context has added to the cache
+    CompileStats stats;   // Of the last compilation
+    uint64_t phase_wall;  // Start of the phase being timed
+    uint64_t phase_cpu;
+    TraceBuffer trace;    // Events of the compilation in progress, when tracing
+    Diagnostics diagnostics;
+    jmp_buf* recover;     // Where parsing goes on after a syntax error
+    ErrorState errors;
+} CompilerContext;
+
+// Programs of at least two ranges of this many tokens are parsed on several
+// threads
+#define PARSE_RANGE_MIN_TOKENS (1 << 16)
+
+// The functions in a range of the tokens, parsed on a thread of its own by a
+// parser context that shares the input, tokens and fragments of the
+// compilation. Its nodes are numbered from 0 and rebased when the ranges are
+// linked into the program.
+typedef struct ParseRange
+{
+    WorkerThread worker;
+    CompilerContext parser;
+    size_t end;           // Range is tokens [parser.token_pos, end)
+    size_t node_base;     // Index of the range's first node in the program
+    size_t function_base;
+    Ast* program;
+    int failed;
+} ParseRange;
+
+// One translation unit: where its source comes from and where its code goes
+typedef struct CompileUnit
+{
+    const char* input_file;  // Source file, "-" for stdin, or NULL to compile source
+    const char* source;
+    size_t source_size;
+    const char* output_file; // Executable to write, or NULL to keep the result in memory
+    int want_asm;            // Keep assembly in ctx->output rather than the executable in ctx->image
+} CompileUnit;
+
+// One input/output pair of a batch and how its compilation went
+typedef struct BatchJob
+{
+    const char* input;
+    const char* output;
+    int status;
+    char message[sizeof(((ErrorState*)0)->message)];
+    char* diagnostics; // Every error found in the input, one per line, or NULL
+    CompileStats stats;
+} BatchJob;
+
+// Batch jobs are claimed in order by worker threads, each compiling with a
+// context of its own that is reused from one job to the next
+typedef struct Batch
+{
+    const CompileOptions* options;
+    BatchJob* jobs;
+    size_t job_count;
+    size_t next_job; // Next job to claim, advanced atomically
+    int cache_stored;
+} Batch;
+
+// Cached outputs are only reused by the compiler version that made them. Bump
+// it whenever the code generated or the format of what is stored changes.
+#define COMPILER_VERSION "chemist 1"
+#define CACHE_MAGIC "CHEMIST1"
+#define CACHE_DEFAULT_LIMIT (256u << 20)
+
+#define HASH_PRIME1 0x9E3779B185EBCA87ull
+#define HASH_PRIME2 0xC2B2AE3D27D4EB4Full
+#define HASH_PRIME3 0x165667B19E3779F9ull
+#define HASH_PRIME4 0x85EBCA77C2B2AE63ull
+#define HASH_PRIME5 0x27D4EB2F165667C5ull
+#define ROTATE_LEFT64(x, n) (((x) << (n)) | ((x) >> (64 - (n))))
+
+// Where an input is cached: the entry's file name and a second, independent
+// hash stored in the entry to tell inputs whose names collide apart
+typedef struct CacheKey
+{
+    uint64_t name;
+    uint64_t check;
+} CacheKey;
+
+// Start of a cache entry file, followed by the executable and then the
+// assembly, if the options write it
+typedef struct CacheHeader
+{
+    char magic[8]; // CACHE_MAGIC
+    uint64_t check;
+    uint64_t input_size;
+    uint64_t elf_size;
+    uint64_t asm_size;
+} CacheHeader;
+
+// A cache entry considered for eviction
+typedef struct CacheEntry
+{
+    int64_t time; // Last use, in nanoseconds
+    uint64_t size;
+    char name[17];
+} CacheEntry;
+
+#define SERVER_RECEIVE_SIZE (64 * 1024)
+#define SERVER_MAX_LINE 4096
+#define SERVER_MAX_SOURCE (256u << 20)
+
+// A compile server: the options every request is compiled with and the socket
+// its workers accept connections on
+typedef struct Server
+{
+    const CompileOptions* options;
+    int fd;
+} Server;
+
+// Bytes received on a server connection; those before start are consumed
+typedef struct ServerConnection
+{
+    int fd;
+    char* data;
+    size_t start;
+    size_t length;
+    size_t capacity;
+} ServerConnection;
+
+// Command line file arguments with response files expanded in place
+typedef struct ArgList
+{
+    const char** items;
+    size_t count;
+    size_t capacity;
+    char** texts; // Response file contents the items point into
+    size_t text_count;
+} ArgList;
+
+// Shape of a synthetic program written by --generate and compiled by --bench.
+// A shape always produces the same program.
+typedef struct GeneratorConfig
+{
+    const char* name;      // Of the benchmark case
+    uint32_t functions;    // Including main, which comes last
+    uint32_t locals;       // Variables each function declares
+    uint32_t statements;   // Assignments and calls after the declarations
+    uint32_t ident_length; // Length of every name but main, at least what its index takes
+    uint32_t spacing;      // White space characters between tokens
+    uint64_t seed;
+} GeneratorConfig;
+
+#define GENERATOR_MAX_COUNT 100000000u
+#define GENERATOR_MAX_LENGTH 4096u
+#define BENCH_DEFAULT_RUNS 5
+
+// The built-in suite varies one axis of the first case at a time
+static const GeneratorConfig bench_suite[] =
+{
+    {"base", 2000, 8, 16, 8, 1, 1},
+    {"functions", 20000, 8, 16, 8, 1, 1},
+    {"locals", 2000, 64, 16, 8, 1, 1},
+    {"statements", 2000, 8, 128, 8, 1, 1},
+    {"identifiers", 2000, 8, 16, 64, 1, 1},
+    {"whitespace", 2000, 8, 16, 8, 16, 1},
+};
+
+// Lexer scanners, chosen once per process by select_scanners()
+size_t (*skip_space)(const char* text, size_t from, size_t end);
+size_t (*scan_ident)(const char* text, size_t from, size_t end);
 
 // Function signatures
-void compile(const char* input_file, const char* output_file);
-void read_input(const char* filename);
-void tokenize();
-void generate_code(Node* node);
-void expect(enum TokenType type);
-void free_ast(Node *node);
-Node* parse_program();
-Node* parse_function();
-Node* parse_stmt_list();
-Node* parse_stmt();
-Node* parse_call();
-Node* parse_return();
-Node* parse_number();
-Node* parse_var_decl();
-Node* parse_var_assign();
-Node* parse_var_ref();
-Token next_token();
-void init_scope();
-void free_scope();
-void add_variable(const char* name);
-int get_variable_offset(const char* name);
+void init_context(CompilerContext* ctx, const CompileOptions* options);
+void free_context(CompilerContext* ctx);
+void fail(ErrorState* errors, const char* format, ...) __attribute__((noreturn, format(printf, 2, 3)));
+void fail_at(ErrorState* errors, size_t offset, const char* format, ...) __attribute__((noreturn, format(printf, 3, 4)));
+void report_error(CompilerContext* ctx, size_t offset, const char* message);
+int reserve_diagnostics(Diagnostics* diagnostics, size_t length);
+size_t find_line(CompilerContext* ctx, size_t offset);
+void check_diagnostics(CompilerContext* ctx);
+void summarize_diagnostics(CompilerContext* ctx);
+void append_diagnostics(Diagnostics* diagnostics, const Diagnostics* more, size_t max_count);
+int compile(CompilerContext* ctx, const char* input_file, const char* output_file);
+size_t compile_batch(const CompileOptions* options, BatchJob* jobs, size_t job_count, int workers);
+void* batch_worker(void* arg);
+int run_server(const CompileOptions* options, const char* path, int workers);
+void* server_worker(void* arg);
+void serve_connection(CompilerContext* ctx, ServerConnection* connection);
+int receive_bytes(ServerConnection* connection, size_t size);
+char* receive_line(ServerConnection* connection);
+int send_reply(int fd, const char* header, const char* data, size_t size);
+int parse_thread_count(const char* text);
+int add_arg(ArgList* args, const char* arg);
+int read_response_file(ArgList* args, const char* path);
+void free_args(ArgList* args);
+int compile_unit(CompilerContext* ctx, const CompileUnit* unit);
+uint64_t clock_ns(clockid_t clock);
+void begin_phase(CompilerContext* ctx);
+void end_phase(CompilerContext* ctx, enum Phase phase);
+void collect_stats(CompilerContext* ctx);
+void print_stats(FILE* out, const char* input, const CompileStats* stats, enum StatsFormat format);
+void print_json_string(FILE* out, const char* text);
+const char* format_bytes(char* buffer, size_t size, uint64_t bytes);
+int open_trace(Trace* trace, const char* path);
+void close_trace(Trace* trace);
+TraceEvent* add_trace_event(TraceBuffer* buffer);
+void trace_event(TraceBuffer* buffer, const char* name, const char* category, uint64_t start_ns, uint64_t end_ns, uint64_t instructions);
+void append_trace(TraceBuffer* buffer, const TraceBuffer* events);
+void write_trace(CompilerContext* ctx, const CompileUnit* unit, uint64_t start_ns, int status);
+uint32_t current_thread_id(void);
+int parse_generator_config(const char* spec, GeneratorConfig* config);
+char* generate_source(const GeneratorConfig* config, size_t* size);
+void generate_program(Emitter* e, const GeneratorConfig* config);
+void emit_generated_value(Emitter* e, const GeneratorConfig* config, uint64_t* random, uint32_t function, uint32_t locals);
+void emit_generated_name(Emitter* e, const GeneratorConfig* config, char prefix, uint32_t index);
+void emit_gap(Emitter* e, uint32_t spacing, int newline, int required);
+uint64_t next_random(uint64_t* state);
+int run_benchmark(const CompileOptions* options, const GeneratorConfig* cases, size_t case_count, int runs,
+                  enum StatsFormat stats_format);
+void translate_unit(CompilerContext* ctx, const CompileUnit* unit);
+uint64_t hash_bytes(const void* data, size_t size, uint64_t seed);
+uint64_t hash_round(uint64_t acc, uint64_t lane);
+CacheKey cache_key(const CompileOptions* options, const char* input, size_t size);
+int cache_fetch(CompilerContext* ctx, const CacheKey* key, const char* output_file, const char* asm_path);
+void cache_store(CompilerContext* ctx, const CacheKey* key, const char* output_file, const char* asm_path);
+int compare_cache_entry_time(const void* a, const void* b);
+void cache_evict(const CompileOptions* options);
+int append_file(const char* path, char** buffer, size_t* capacity, size_t* length);
+int write_file(const char* path, const char* data, size_t size, mode_t mode);
+int make_directories(const char* path);
+void load_fragments(CompilerContext* ctx, const char* output_file);
+uint32_t find_fragment(const FragmentTable* table, uint64_t fingerprint);
+void splice_fragment(CodeGen* cg, const Fragment* fragment);
+void collect_fragments(CompilerContext* ctx);
+void save_fragments(CompilerContext* ctx);
+size_t function_end(const CompilerContext* ctx);
+void read_input(CompilerContext* ctx, const char* filename);
+void copy_input(CompilerContext* ctx, const char* source, size_t size);
+int map_input(CompilerContext* ctx, int fd, size_t size);
+void read_input_stream(CompilerContext* ctx, int fd, const char* filename);
+void free_input(CompilerContext* ctx);
+void tokenize(CompilerContext* ctx);
+void tokenize_parallel(CompilerContext* ctx, size_t chunk_count);
+size_t lex_boundary(const char* input, size_t from, size_t end);
+uint64_t run_workers(void* items, size_t item_size, size_t count, void* (*worker)(void*));
+void* lex_chunk(void* arg);
+void* stitch_chunk(void* arg);
+void free_lex_chunk(LexChunk* chunk);
+void start_token_stream(CompilerContext* ctx);
+Token* peek_token(CompilerContext* ctx, size_t ahead);
+void advance_token(CompilerContext* ctx);
+void eliminate_dead_functions(CompilerContext* ctx);
+void report_undefined_function(CompilerContext* ctx, size_t offset, uint32_t name);
+const Node* stmt_call(const Ast* ast, const Node* stmt);
+uint32_t fragment_call(const FragmentTable* table, const Fragment* fragment, uint32_t i);
+void check_names(CompilerContext* ctx);
+const Node* check_function(const Ast* ast, const Function* func, uint32_t* declared, uint32_t epoch);
+void optimize_ast(CompilerContext* ctx);
+uint32_t stmt_callee(const Ast* ast, const Optimizer* opt, const Node* stmt);
+int is_inlinable(const Ast* ast, const Optimizer* opt, uint32_t f);
+void inline_calls(Ast* ast, const Optimizer* opt, uint32_t f);
+VarFact* find_fact(VarFact* facts, uint32_t epoch, uint32_t name);
+void propagate_value(Node* value, VarFact* facts, uint32_t epoch);
+void store_value(VarFact* fact, const Node* value);
+void optimize_function(Ast* ast, Function* func, VarFact* facts, uint32_t epoch);
+void generate_code(CompilerContext* ctx);
+void gen_function(CodeGen* cg, const Ast* ast, const Function* func);
+int gen_functions(CodeGen* cg, const Ast* ast, size_t first, size_t end);
+int compare_codegen_failures(const void* a, const void* b);
+void free_codegen(CodeGen* cg);
+void generate_parallel(CompilerContext* ctx);
+void run_codegen_batch(CodegenWorker* worker, size_t batch);
+void unwind_codegen(CodeGen* cg);
+void* codegen_worker(void* arg);
+void gen_value_stack(CodeGen* cg, const Node* value, const char* context);
+void gen_function_stack(CodeGen* cg, const Ast* ast, const Function* func);
+void gen_return_stack(CodeGen* cg, int frame_size);
+int layout_frame(CodeGen* cg, const Ast* ast, const Function* func);
+int stmt_variables(const Ast* ast, const Node* stmt, uint32_t names[2]);
+void gen_function_regalloc(CodeGen* cg, const Ast* ast, const Function* func);
+uint32_t new_vreg(CodeGen* cg);
+void add_ir(CodeGen* cg, enum IrOp op, uint32_t dst, uint32_t src, int imm, uint32_t name);
+uint32_t lower_value(CodeGen* cg, const Node* value, uint32_t dst);
+void lower_function(CodeGen* cg, const Ast* ast, const Function* func);
+void compute_intervals(CodeGen* cg);
+int compare_interval_start(const void* a, const void* b);
+void allocate_registers(CodeGen* cg, RegAlloc* ra);
+int is_callee_saved(int reg);
+enum Register gen_use(CodeGen* cg, uint32_t vreg);
+void gen_def(CodeGen* cg, uint32_t vreg, enum Register reg);
+int spill_offset(int slot);
+void gen_epilogue(CodeGen* cg, const RegAlloc* ra);
+void emit_reserve(Emitter* e, size_t length);
+void emit_text(Emitter* e, const char* text, size_t length);
+void emit_int(Emitter* e, int value);
+void emit_name(Emitter* e, uint32_t name);
+void emit_reg(Emitter* e, enum Register reg);
+void emit_reg32(Emitter* e, enum Register reg);
+void emit_flush(Emitter* e);
+void emit_label(Emitter* e, uint32_t name);
+void emit_call(Emitter* e, uint32_t name);
+void emit_mov_imm(Emitter* e, enum Register reg, int value);
+void emit_load_local(Emitter* e, enum Register reg, int offset);
+void emit_store_local(Emitter* e, int offset, enum Register reg);
+void emit_load_local32(Emitter* e, enum Register reg, int offset);
+void emit_store_local32(Emitter* e, int offset, enum Register reg);
+void emit_sub_imm(Emitter* e, enum Register reg, int value);
+void emit_add_imm(Emitter* e, enum Register reg, int value);
+void emit_byte(Emitter* e, uint8_t value);
+void emit_u32(Emitter* e, uint32_t value);
+Inst* add_inst(CodeGen* cg, enum Opcode op);
+void gen_label(CodeGen* cg, uint32_t name);
+void gen_reg(CodeGen* cg, enum Opcode op, enum Register reg);
+void gen_mov(CodeGen* cg, enum Register dst, enum Register src);
+void gen_mov_imm(CodeGen* cg, enum Register dst, int value);
+void gen_load_local(CodeGen* cg, enum Register dst, int offset);
+void gen_store_local(CodeGen* cg, int offset, enum Register src);
+void gen_load_local32(CodeGen* cg, enum Register dst, int offset);
+void gen_store_local32(CodeGen* cg, int offset, enum Register src);
+void gen_sub_imm(CodeGen* cg, enum Register dst, int value);
+void gen_add_imm(CodeGen* cg, enum Register dst, int value);
+void gen_call(CodeGen* cg, uint32_t name);
+void gen_op(CodeGen* cg, enum Opcode op);
+void peephole(Code* code, uint32_t main_name);
+void print_code(Emitter* e, const Code* code);
+void encode_rex_w(Emitter* e, int reg, int rm);
+void encode_rr(Emitter* e, uint8_t opcode, int reg, int rm);
+void encode_rbp_local(Emitter* e, uint8_t opcode, int reg, int offset, int wide);
+void encode_code(Emitter* e, const Code* code, size_t* label_offsets, Fixup** fixups, size_t* fixup_capacity, size_t* fixup_count);
+void put_u16(char* p, uint16_t value);
+void put_u32(char* p, uint32_t value);
+void put_u64(char* p, uint64_t value);
+void put_program_header(char* p, uint32_t flags, uint64_t offset, uint64_t address, uint64_t size);
+void build_elf(CompilerContext* ctx);
+void write_elf(CompilerContext* ctx, const char* path);
+void write_asm(CompilerContext* ctx, const char* path);
+void expect(CompilerContext* ctx, enum TokenType type);
+void syntax_error(CompilerContext* ctx, const char* expected) __attribute__((noreturn));
+void skip_statement(CompilerContext* ctx);
+void skip_function(CompilerContext* ctx);
+void* arena_alloc(ErrorState* errors, Arena* arena, size_t size);
+char* arena_strndup(ErrorState* errors, Arena* arena, const char* text, size_t length);
+void arena_reset(Arena* arena);
+void arena_free(Arena* arena);
+size_t arena_bytes(const Arena* arena);
+void* grow_array(ErrorState* errors, void* items, size_t* capacity, size_t item_size);
+uint32_t add_node(Ast* ast, Node node);
+void push_pending(Ast* ast, Node node);
+uint32_t node_offset(size_t offset);
+size_t node_location(const Node* node);
+void reset_ast(Ast* ast);
+void parse_program(CompilerContext* ctx);
+void parse_functions(CompilerContext* ctx, size_t end);
+void parse_parallel(CompilerContext* ctx, size_t range_count);
+size_t parse_boundary(const CompilerContext* ctx, size_t from);
+void* parse_range(void* arg);
+void* link_range(void* arg);
+void free_parse_range(ParseRange* range);
+void parse_function(CompilerContext* ctx);
+void add_function(CompilerContext* ctx, Function func);
+void parse_stmt_list(CompilerContext* ctx, uint32_t* first, uint32_t* count);
+Node parse_stmt(CompilerContext* ctx);
+uint32_t parse_expr(CompilerContext* ctx);
+Node parse_call(CompilerContext* ctx);
+Node parse_return(CompilerContext* ctx);
+Node parse_number(CompilerContext* ctx);
+Node parse_var_decl(CompilerContext* ctx);
+Node parse_var_assign(CompilerContext* ctx);
+Node parse_var_ref(CompilerContext* ctx);
+Token next_token(CompilerContext* ctx);
+Token lex_token(const char* input, size_t* pos, size_t end, InternTable* names);
+void select_scanners(int allow_simd);
+size_t skip_space_scalar(const char* text, size_t from, size_t end);
+size_t scan_ident_scalar(const char* text, size_t from, size_t end);
+uint32_t hash_name(const char* text, size_t length);
+uint32_t intern(InternTable* names, const char* text, size_t length);
+const char* name_text(const InternTable* names, uint32_t id);
+void reset_names(InternTable* names);
+void free_names(InternTable* names);
+int token_number(CompilerContext* ctx, const Token* token);
+void push_scope(CodeGen* cg);
+void pop_scope(CodeGen* cg);
+void track_symbol_bytes(CodeGen* cg, size_t bytes);
+Symbol* find_symbol(const Scope* scope, uint32_t name);
+void grow_scope(ErrorState* errors, Scope* scope);
+Symbol* add_variable(CodeGen* cg, const Node* decl);
+Symbol* lookup_variable(CodeGen* cg, uint32_t name);
+Symbol* use_variable(CodeGen* cg, const Node* node);
 
 int main(int argc, char** argv)
 {
-    if (argc != 3)
+    ArgList files = {0};
+    int allow_simd = 1;
+    int workers = 1;
+    const char* server_path = NULL;
+    int use_cache = 1;
+    enum StatsFormat stats_format = STATS_NONE;
+    int generate = 0;
+    int bench = 0;
+    int bench_runs = BENCH_DEFAULT_RUNS;
+    int custom_shape = 0;
+    GeneratorConfig shape = bench_suite[0];
+    const char* trace_path = NULL;
+    Trace trace;
+    char default_cache_dir[PATH_MAX];
+    CompileOptions options = {.threads = 1, .cache_limit = CACHE_DEFAULT_LIMIT};
+    for (int i = 1; i < argc; i++)
     {
-        fprintf(stderr, "Usage: %s <input.c> <output>\n", argv[0]);
-        return 1;
+        if (strcmp(argv[i], "--stream") == 0)
+        {
+            options.streaming = 1;
+        }
+        else if (strcmp(argv[i], "--no-simd") == 0)
+        {
+            allow_simd = 0;
+        }
+        else if (strcmp(argv[i], "--emit-asm") == 0)
+        {
+            options.emit_asm = 1;
+        }
+        else if (strcmp(argv[i], "--fasm") == 0)
+        {
+            options.use_fasm = 1;
+        }
+        else if (strncmp(argv[i], "--threads=", 10) == 0)
+        {
+            options.threads = parse_thread_count(argv[i] + 10);
+            if (options.threads < 0)
+            {
+                fprintf(stderr, "Error: Invalid thread count %s\n", argv[i]);
+                free_args(&files);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--stats") == 0 || strcmp(argv[i], "--stats=text") == 0)
+        {
+            stats_format = STATS_TEXT;
+        }
+        else if (strcmp(argv[i], "--stats=json") == 0)
+        {
+            stats_format = STATS_JSON;
+        }
+        else if (strncmp(argv[i], "--generate=", 11) == 0 || strncmp(argv[i], "--bench=", 8) == 0)
+        {
+            generate = argv[i][2] == 'g';
+            bench = !generate;
+            custom_shape = 1;
+            shape.name = "custom";
+            if (parse_generator_config(strchr(argv[i], '=') + 1, &shape) != 0)
+            {
+                fprintf(stderr, "Error: Invalid program shape %s\n", argv[i]);
+                free_args(&files);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--bench") == 0)
+        {
+            bench = 1;
+        }
+        else if (strncmp(argv[i], "--bench-runs=", 13) == 0)
+        {
+            char* end;
+            long runs = strtol(argv[i] + 13, &end, 10);
+            if (argv[i][13] == '\0' || *end != '\0' || runs < 1 || runs > 1000000)
+            {
+                fprintf(stderr, "Error: Invalid run count %s\n", argv[i]);
+                free_args(&files);
+                return 1;
+            }
+            bench_runs = (int)runs;
+        }
+        else if (strncmp(argv[i], "--trace=", 8) == 0 && argv[i][8] != '\0')
+        {
+            trace_path = argv[i] + 8;
+        }
+        else if (strcmp(argv[i], "--incremental") == 0)
+        {
+            options.incremental = 1;
+        }
+        else if (strcmp(argv[i], "--no-cache") == 0)
+        {
+            use_cache = 0;
+        }
+        else if (strncmp(argv[i], "--cache-dir=", 12) == 0 && argv[i][12] != '\0')
+        {
+            options.cache_dir = argv[i] + 12;
+        }
+        else if (strncmp(argv[i], "--cache-size=", 13) == 0)
+        {
+            char* end;
+            unsigned long long megabytes = strtoull(argv[i] + 13, &end, 10);
+            if (argv[i][13] == '\0' || *end != '\0' || megabytes > (UINT64_MAX >> 20))
+            {
+                fprintf(stderr, "Error: Invalid cache size %s\n", argv[i]);
+                free_args(&files);
+                return 1;
+            }
+            options.cache_limit = (uint64_t)megabytes << 20;
+        }
+        else if (strncmp(argv[i], "--server=", 9) == 0 && argv[i][9] != '\0')
+        {
+            server_path = argv[i] + 9;
+        }
+        else if (argv[i][0] == '-' && argv[i][1] == 'j')
+        {
+            workers = parse_thread_count(argv[i] + 2);
+            if (workers < 0)
+            {
+                fprintf(stderr, "Error: Invalid job count %s\n", argv[i]);
+                free_args(&files);
+                return 1;
+            }
+        }
+        else if (argv[i][0] == '-' && argv[i][1] == 'O')
+        {
+            char* end;
+            long level = strtol(argv[i] + 2, &end, 10);
+            if (argv[i][2] == '\0')
+            {
+                level = 1;
+            }
+            else if (*end != '\0' || level < 0)
+            {
+                fprintf(stderr, "Error: Invalid optimization level %s\n", argv[i]);
+                free_args(&files);
+                return 1;
+            }
+            options.opt_level = level > 3 ? 3 : (int)level;
+        }
+        else if (argv[i][0] == '-' && argv[i][1] != '\0')
+        {
+            fprintf(stderr, "Error: Unknown option %s\n", argv[i]);
+            free_args(&files);
+            return 1;
+        }
+        else if (argv[i][0] == '@')
+        {
+            if (read_response_file(&files, argv[i] + 1) != 0)
+            {
+                free_args(&files);
+                return 1;
+            }
+        }
+        else if (add_arg(&files, argv[i]) != 0)
+        {
+            free_args(&files);
+            return 1;
+        }
     }
 
-    char asmFile[50] = {0};
-    strcpy(asmFile, argv[2]);
-    strcat(asmFile, ".asm");
-
-    compile(argv[1], asmFile);
+    int usage_error = server_path || bench ? files.count != 0 : generate ? files.count != 1 : files.count == 0 || files.count % 2 != 0;
+    if (usage_error || (server_path && (generate || bench)) || (generate && bench))
+    {
+        fprintf(stderr, "Usage: %s [options] <input.c|-> <output> [<input.c> <output>...]\n", argv[0]);
+        fprintf(stderr, "       %s [options] @<response file>\n", argv[0]);
+        fprintf(stderr, "       %s [options] --server=<socket>\n", argv[0]);
+        fprintf(stderr, "       %s [options] --bench[=<shape>]\n", argv[0]);
+        fprintf(stderr, "       %s --generate=<shape> <output.c|->\n", argv[0]);
+        fprintf(stderr, "  --stream          lex on demand with bounded lookahead instead of tokenizing the whole input first\n");
+        fprintf(stderr, "  --no-simd         use the scalar lexer scanners even when vector ones are available\n");
+        fprintf(stderr, "  --emit-asm        also write the generated assembly to <output>.asm\n");
+        fprintf(stderr, "  --fasm            assemble <output>.asm with fasm instead of the built-in encoder\n");
+        fprintf(stderr, "  --threads=<n>     lex, parse and generate code for large programs on n threads, 0 for one per CPU\n");
+        fprintf(stderr, "                    (default 1)\n");
+        fprintf(stderr, "  -j<n>             compile n input files or server requests at a time, 0 for one per CPU (default 1)\n");
+        fprintf(stderr, "  --stats[=json]    report the time of each phase, counts and peak memory per input to stderr\n");
+        fprintf(stderr, "  --trace=<f>       write the phases and the code generation of each function to f in\n");
+        fprintf(stderr, "                    Chrome Trace Event format\n");
+        fprintf(stderr, "  --incremental     reuse the code of functions unchanged since <output> was last compiled,\n");
+        fprintf(stderr, "                    kept in <output>.fragments (-O0 and -O1 only)\n");
+        fprintf(stderr, "  --no-cache        always compile instead of reusing outputs cached for identical input\n");
+        fprintf(stderr, "  --cache-dir=<d>   keep cached outputs in d (default $XDG_CACHE_HOME/chemist or ~/.cache/chemist)\n");
+        fprintf(stderr, "  --cache-size=<n>  evict the least recently used outputs beyond n MiB (default 256)\n");
+        fprintf(stderr, "  --server=<s>      serve compile requests on the Unix socket s instead of compiling files\n");
+        fprintf(stderr, "  --bench[=<g>]     time the phases of compiling the synthetic programs of the built-in suite,\n");
+        fprintf(stderr, "                    or the one shaped by g, in memory and report their throughput\n");
+        fprintf(stderr, "  --bench-runs=<n>  report the fastest of n compilations of each program (default %d)\n", BENCH_DEFAULT_RUNS);
+        fprintf(stderr, "  --generate=<g>    write the synthetic program shaped by g instead of compiling\n");
+        fprintf(stderr, "  -O<n>             0 keeps every variable on the stack (default), 1 and up fold constants,\n");
+        fprintf(stderr, "                    remove dead stores, allocate registers and shorten instruction\n");
+        fprintf(stderr, "                    sequences, 2 and up also inline small functions\n");
+        fprintf(stderr, "A response file lists further input and output pairs separated by white space.\n");
+        fprintf(stderr, "A shape is a comma separated list of functions=<n>, locals=<n> (per function),\n");
+        fprintf(stderr, "statements=<n> (per function, after the locals), ident=<n> (name length), space=<n>\n");
+        fprintf(stderr, "(white space between tokens) and seed=<n>, each left out taken from the \"base\" case.\n");
+        free_args(&files);
+        return 1;
+    }
+    select_scanners(allow_simd);
+    if (generate)
+    {
+        size_t size;
+        char* source = generate_source(&shape, &size);
+        if (!source)
+        {
+            fprintf(stderr, "Error: Memory allocation failed for generated program\n");
+            free_args(&files);
+            return 1;
+        }
+        int write_failed = strcmp(files.items[0], "-") == 0 ? fwrite(source, 1, size, stdout) != size || fflush(stdout) != 0
+                                                            : write_file(files.items[0], source, size, 0666) != 0;
+        if (write_failed)
+        {
+            fprintf(stderr, "Error: cannot write output file %s\n", files.items[0]);
+        }
+        free(source);
+        free_args(&files);
+        return write_failed;
+    }
+    if (trace_path)
+    {
+        if (open_trace(&trace, trace_path) != 0)
+        {
+            fprintf(stderr, "Error: cannot write trace file %s\n", trace_path);
+            free_args(&files);
+            return 1;
+        }
+        options.trace = &trace;
+    }
+    if (bench)
+    {
+        free_args(&files);
+        int status = custom_shape ? run_benchmark(&options, &shape, 1, bench_runs, stats_format)
+                                  : run_benchmark(&options, bench_suite, sizeof(bench_suite) / sizeof(bench_suite[0]), bench_runs, stats_format);
+        if (options.trace)
+        {
+            close_trace(options.trace);
+        }
+        return status;
+    }
+    if (!use_cache)
+    {
+        options.cache_dir = NULL;
+    }
+    else if (!options.cache_dir)
+    {
+        const char* xdg = getenv("XDG_CACHE_HOME");
+        const char* home = getenv("HOME");
+        int length = -1;
+        if (xdg && xdg[0] == '/')
+        {
+            length = snprintf(default_cache_dir, sizeof(default_cache_dir), "%s/chemist", xdg);
+        }
+        else if (home && home[0] == '/')
+        {
+            length = snprintf(default_cache_dir, sizeof(default_cache_dir), "%s/.cache/chemist", home);
+        }
+        // Without a place for it there is no cache
+        options.cache_dir = length > 0 && length < (int)sizeof(default_cache_dir) ? default_cache_dir : NULL;
+    }
+    if (server_path)
+    {
+        free_args(&files);
+        int status = run_server(&options, server_path, workers);
+        if (options.trace)
+        {
+            close_trace(options.trace);
+        }
+        return status;
+    }
 
-    char asmCommand[50] = {0};
-    strcpy(asmCommand, "fasm ");
-    strcat(asmCommand, asmFile);
+    size_t job_count = files.count / 2;
+    BatchJob* jobs = (BatchJob*)calloc(job_count, sizeof(BatchJob));
+    if (!jobs)
+    {
+        fprintf(stderr, "Error: Memory allocation failed for batch\n");
+        if (options.trace)
+        {
+            close_trace(options.trace);
+        }
+        free_args(&files);
+        return 1;
+    }
+    for (size_t i = 0; i < job_count; i++)
+    {
+        jobs[i].input = files.items[2 * i];
+        jobs[i].output = files.items[2 * i + 1];
+    }
+    size_t failures = compile_batch(&options, jobs, job_count, workers);
+
+    // Report in input order whatever order the jobs finished in
+    for (size_t i = 0; i < job_count; i++)
+    {
+        if (jobs[i].diagnostics)
+        {
+            fputs(jobs[i].diagnostics, stderr);
+            free(jobs[i].diagnostics);
+        }
+        else if (jobs[i].status != 0 && job_count == 1)
+        {
+            fprintf(stderr, "Error: %s\n", jobs[i].message);
+        }
+        else if (jobs[i].status != 0)
+        {
+            fprintf(stderr, "Error: %s: %s\n", jobs[i].input, jobs[i].message);
+        }
+        if (stats_format != STATS_NONE)
+        {
+            print_stats(stderr, jobs[i].input, &jobs[i].stats, stats_format);
+        }
+    }
+    if (job_count > 1 && failures > 0)
+    {
+        fprintf(stderr, "%zu of %zu files failed to compile\n", failures, job_count);
+    }
+    if (options.trace)
+    {
+        close_trace(options.trace);
+    }
+    free(jobs);
+    free_args(&files);
+    return failures != 0;
+}
+
+// Parse a thread count where 0 stands for one per CPU. Returns -1 when text
+// is not a count.
+int parse_thread_count(const char* text)
+{
+    char* end;
+    long threads = strtol(text, &end, 10);
+    if (text[0] == '\0' || *end != '\0' || threads < 0)
+    {
+        return -1;
+    }
+    if (threads == 0)
+    {
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    return threads < 1 ? 1 : threads > 256 ? 256 : (int)threads;
+}
+
+int add_arg(ArgList* args, const char* arg)
+{
+    if (args->count == args->capacity)
+    {
+        size_t grown = args->capacity ? args->capacity * 2 : 64;
+        const char** items = (const char**)realloc(args->items, grown * sizeof(const char*));
+        if (!items)
+        {
+            fprintf(stderr, "Error: Memory allocation failed for arguments\n");
+            return -1;
+        }
+        args->items = items;
+        args->capacity = grown;
+    }
+    args->items[args->count++] = arg;
+    return 0;
+}
+
+// Append the white space separated words of a response file to args. The
+// file stays in memory, terminated word by word, for as long as args does.
+int read_response_file(ArgList* args, const char* path)
+{
+    FILE* file = fopen(path, "rb");
+    if (!file)
+    {
+        fprintf(stderr, "Error: cannot open response file %s\n", path);
+        return -1;
+    }
+    char** texts = (char**)realloc(args->texts, (args->text_count + 1) * sizeof(char*));
+    if (!texts)
+    {
+        fclose(file);
+        fprintf(stderr, "Error: Memory allocation failed for response file %s\n", path);
+        return -1;
+    }
+    args->texts = texts;
+
+    char* text = NULL;
+    size_t length = 0;
+    size_t capacity = 0;
+    for (;;)
+    {
+        if (capacity - length < 2)
+        {
+            capacity = capacity ? capacity * 2 : 4096;
+            char* grown = (char*)realloc(text, capacity);
+            if (!grown)
+            {
+                free(text);
+                fclose(file);
+                fprintf(stderr, "Error: Memory allocation failed for response file %s\n", path);
+                return -1;
+            }
+            text = grown;
+        }
+        size_t n = fread(text + length, 1, capacity - length - 1, file);
+        length += n;
+        if (n == 0)
+        {
+            break;
+        }
+    }
+    int read_failed = ferror(file);
+    fclose(file);
+    if (read_failed)
+    {
+        free(text);
+        fprintf(stderr, "Error: cannot read response file %s\n", path);
+        return -1;
+    }
+    text[length] = '\0';
+    args->texts[args->text_count++] = text;
+
+    for (size_t i = 0; i < length;)
+    {
+        while (i < length && (char_class[(unsigned char)text[i]] & CC_SPACE))
+        {
+            i++;
+        }
+        if (i == length)
+        {
+            break;
+        }
+        size_t start = i;
+        while (i < length && !(char_class[(unsigned char)text[i]] & CC_SPACE))
+        {
+            i++;
+        }
+        text[i++] = '\0';
+        if (add_arg(args, text + start) != 0)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void free_args(ArgList* args)
+{
+    for (size_t i = 0; i < args->text_count; i++)
+    {
+        free(args->texts[i]);
+    }
+    free(args->texts);
+    free(args->items);
+}
+
+void init_context(CompilerContext* ctx, const CompileOptions* options)
+{
+    memset(ctx, 0, sizeof(CompilerContext));
+    ctx->options = *options;
+    ctx->input_fd = -1;
+    ctx->names.errors = &ctx->errors;
+    ctx->ast.errors = &ctx->errors;
+    ctx->output.names = &ctx->names;
+    ctx->output.errors = &ctx->errors;
+    ctx->image.names = &ctx->names;
+    ctx->image.errors = &ctx->errors;
+    ctx->fragments.file.names = &ctx->names;
+    ctx->fragments.file.errors = &ctx->errors;
+}
+
+void free_context(CompilerContext* ctx)
+{
+    free(ctx->tokens);
+    free(ctx->ast.nodes);
+    free(ctx->ast.functions);
+    free(ctx->ast.pending);
+    for (size_t c = 0; c < ctx->lex_chunk_capacity; c++)
+    {
+        free_lex_chunk(&ctx->lex_chunks[c]);
+    }
+    free(ctx->lex_chunks);
+    for (size_t r = 0; r < ctx->parse_range_capacity; r++)
+    {
+        free_parse_range(&ctx->parse_ranges[r]);
+    }
+    free(ctx->parse_ranges);
+    free_names(&ctx->names);
+    free(ctx->code.insts);
+    free_codegen(&ctx->codegen);
+    free(ctx->output.data);
+    free(ctx->image.data);
+    free(ctx->label_offsets);
+    free(ctx->fixups);
+    free(ctx->asm_path);
+    free(ctx->cache_buffer);
+    free(ctx->fragments.path);
+    free(ctx->fragments.data);
+    free(ctx->fragments.fragments);
+    free(ctx->fragments.slots);
+    free(ctx->fragments.names);
+    free(ctx->fragments.file_names);
+    free(ctx->fragments.file.data);
+    free(ctx->trace.events);
+    free(ctx->diagnostics.text);
+    free(ctx->diagnostics.lines);
+}
+
+// Record an error and abandon the work started under errors
+void fail(ErrorState* errors, const char* format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    vsnprintf(errors->message, sizeof(errors->message), format, args);
+    va_end(args);
+    errors->offset = SIZE_MAX;
+    longjmp(errors->jump, 1);
+}
+
+// Record an error in the program at offset in the input and abandon the work
+// started under errors
+void fail_at(ErrorState* errors, size_t offset, const char* format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    vsnprintf(errors->message, sizeof(errors->message), format, args);
+    va_end(args);
+    errors->offset = offset;
+    longjmp(errors->jump, 1);
+}
+
+// Add an error at offset in the input, SIZE_MAX for none, to the report of
+// the compilation. The report only informs, so an error there is no memory
+// for is counted but not described.
+void report_error(CompilerContext* ctx, size_t offset, const char* message)
+{
+    Diagnostics* diagnostics = &ctx->diagnostics;
+    if (++diagnostics->count > DIAGNOSTICS_MAX + 1)
+    {
+        return;
+    }
+    char location[48] = "";
+    size_t line = offset == SIZE_MAX ? SIZE_MAX : find_line(ctx, offset);
+    if (line != SIZE_MAX)
+    {
+        snprintf(location, sizeof(location), ":%zu:%zu", line + 1, offset - diagnostics->lines[line] + 1);
+    }
+    int length = snprintf(NULL, 0, "%s%s: error: %s\n", diagnostics->input, location, message);
+    if (reserve_diagnostics(diagnostics, length) != 0)
+    {
+        return;
+    }
+    snprintf(diagnostics->text + diagnostics->length, length + 1, "%s%s: error: %s\n", diagnostics->input, location, message);
+    diagnostics->length += length;
+}
+
+// Make room for length more bytes of text and the '\0' after them. Returns
+// -1 when there is no memory for them.
+int reserve_diagnostics(Diagnostics* diagnostics, size_t length)
+{
+    if (diagnostics->length + length + 1 > diagnostics->capacity)
+    {
+        size_t capacity = diagnostics->capacity ? diagnostics->capacity : 4096;
+        while (capacity < diagnostics->length + length + 1) capacity *= 2;
+        char* text = (char*)realloc(diagnostics->text, capacity);
+        if (!text)
+        {
+            return -1;
+        }
+        diagnostics->text = text;
+        diagnostics->capacity = capacity;
+    }
+    return 0;
+}
+
+// Line of the input offset is on, counting from 0, or SIZE_MAX when there is
+// no memory to tell. The first error of a compilation indexes where each line
+// starts, so compiling a correct program never pays for it and each further
+// error costs a binary search.
+size_t find_line(CompilerContext* ctx, size_t offset)
+{
+    Diagnostics* diagnostics = &ctx->diagnostics;
+    if (diagnostics->line_count == 0)
+    {
+        const char* end = ctx->input + ctx->input_size;
+        for (const char* line = ctx->input; line;)
+        {
+            if (diagnostics->line_count == diagnostics->line_capacity)
+            {
+                size_t grown = diagnostics->line_capacity ? diagnostics->line_capacity * 2 : 1024;
+                size_t* lines = (size_t*)realloc(diagnostics->lines, grown * sizeof(size_t));
+                if (!lines)
+                {
+                    diagnostics->line_count = 0;
+                    return SIZE_MAX;
+                }
+                diagnostics->lines = lines;
+                diagnostics->line_capacity = grown;
+            }
+            diagnostics->lines[diagnostics->line_count++] = (size_t)(line - ctx->input);
+            line = (const char*)memchr(line, '\n', (size_t)(end - line));
+            line = line ? line + 1 : NULL;
+        }
+    }
+    size_t low = 0;
+    size_t high = diagnostics->line_count;
+    while (high - low > 1)
+    {
+        size_t middle = low + (high - low) / 2;
+        if (diagnostics->lines[middle] <= offset)
+        {
+            low = middle;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+// A program with errors goes no further than the phase that found them
+void check_diagnostics(CompilerContext* ctx)
+{
+    if (ctx->diagnostics.count > 0)
+    {
+        ctx->diagnostics.complete = 1;
+        fail(&ctx->errors, "%zu errors", ctx->diagnostics.count);
+    }
+}
+
+// Sum up the report in the error message, for those who read a single line:
+// its first error and how many more follow
+void summarize_diagnostics(CompilerContext* ctx)
+{
+    const Diagnostics* diagnostics = &ctx->diagnostics;
+    const char* first = diagnostics->length ? diagnostics->text : "";
+    int length = (int)strcspn(first, "\n");
+    if (diagnostics->count > 1)
+    {
+        snprintf(ctx->errors.message, sizeof(ctx->errors.message), "%.*s (and %zu more)", length, first, diagnostics->count - 1);
+    }
+    else
+    {
+        snprintf(ctx->errors.message, sizeof(ctx->errors.message), "%.*s", length, first);
+    }
+}
+
+// Append the errors of another report of the same input, as many as keep
+// diagnostics within max_count
+void append_diagnostics(Diagnostics* diagnostics, const Diagnostics* more, size_t max_count)
+{
+    size_t count = more->count;
+    if (diagnostics->count + count > max_count)
+    {
+        count = diagnostics->count < max_count ? max_count - diagnostics->count : 0;
+    }
+    size_t length = 0;
+    for (size_t i = 0; i < count && length < more->length; i++)
+    {
+        const char* end = (const char*)memchr(more->text + length, '\n', more->length - length);
+        length = end ? (size_t)(end - more->text) + 1 : more->length;
+    }
+    diagnostics->count += count;
+    if (length == 0 || reserve_diagnostics(diagnostics, length) != 0)
+    {
+        return;
+    }
+    memcpy(diagnostics->text + diagnostics->length, more->text, length);
+    diagnostics->length += length;
+    diagnostics->text[diagnostics->length] = '\0';
+}
+
+// Compile input_file ("-" for stdin) into the executable output_file. Returns
+// 0, or -1 with the reason in ctx->errors.message. Either way the context is
+// ready for the next compilation.
+int compile(CompilerContext* ctx, const char* input_file, const char* output_file)
+{
+    CompileUnit unit = {.input_file = input_file, .output_file = output_file};
+    return compile_unit(ctx, &unit);
+}
+
+// Compile one unit; returns like compile(). Results kept in memory stay valid
+// until the next compilation with ctx.
+int compile_unit(CompilerContext* ctx, const CompileUnit* unit)
+{
+    ctx->errors.message[0] = '\0';
+    memset(&ctx->stats, 0, sizeof(ctx->stats));
+    Diagnostics* diagnostics = &ctx->diagnostics;
+    diagnostics->length = 0;
+    diagnostics->count = 0;
+    diagnostics->complete = 0;
+    diagnostics->line_count = 0;
+    diagnostics->input = !unit->input_file ? "<source>" : strcmp(unit->input_file, "-") == 0 ? "<stdin>" : unit->input_file;
+    uint64_t start_ns = ctx->options.trace ? clock_ns(CLOCK_MONOTONIC) : 0;
+    if (ctx->options.trace)
+    {
+        ctx->trace.thread = current_thread_id();
+    }
+    volatile int status = -1; // Set after setjmp(), so must survive a longjmp()
+    if (setjmp(ctx->errors.jump) == 0)
+    {
+        translate_unit(ctx, unit);
+        status = 0;
+    }
+    if (status != 0 && (diagnostics->count > 0 || ctx->errors.offset != SIZE_MAX))
+    {
+        // A failure that ended the search for errors is the last of them
+        if (!diagnostics->complete)
+        {
+            report_error(ctx, ctx->errors.offset, ctx->errors.message);
+        }
+        summarize_diagnostics(ctx);
+    }
+    collect_stats(ctx);
+    if (ctx->options.trace)
+    {
+        write_trace(ctx, unit, start_ns, status);
+    }
+
+    // Clean up, keeping the arrays for the next compilation
+    if (ctx->output.file)
+    {
+        fclose(ctx->output.file);
+        ctx->output.file = NULL;
+    }
+    ctx->code.count = 0;
+    ctx->fragments.enabled = 0;
+    ctx->fragments.count = 0;
+    unwind_codegen(&ctx->codegen);
+    reset_ast(&ctx->ast);
+    reset_names(&ctx->names);
+    free_input(ctx);
+    return status;
+}
+
+uint64_t clock_ns(clockid_t clock)
+{
+    struct timespec now;
+    clock_gettime(clock, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+// Phases are timed back to back: each end_phase() charges the time since the
+// previous one, or since begin_phase(), to phase
+void begin_phase(CompilerContext* ctx)
+{
+    ctx->phase_wall = clock_ns(CLOCK_MONOTONIC);
+    ctx->phase_cpu = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+}
+
+void end_phase(CompilerContext* ctx, enum Phase phase)
+{
+    uint64_t wall = clock_ns(CLOCK_MONOTONIC);
+    uint64_t cpu = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+    ctx->stats.phases[phase].wall_ns += wall - ctx->phase_wall;
+    ctx->stats.phases[phase].cpu_ns += cpu - ctx->phase_cpu;
+    if (ctx->options.trace)
+    {
+        trace_event(&ctx->trace, phase_names[phase], "phase", ctx->phase_wall, wall, 0);
+    }
+    ctx->phase_wall = wall;
+    ctx->phase_cpu = cpu;
+}
+
+// Fill in the counts and sizes of the compilation that just ended, whether
+// it succeeded or not. The arrays only grow, so their capacities are peaks.
+void collect_stats(CompilerContext* ctx)
+{
+    CompileStats* stats = &ctx->stats;
+    stats->input_bytes = ctx->input_size;
+    stats->tokens = ctx->token_count;
+    stats->nodes = ctx->ast.node_count;
+    stats->functions = ctx->ast.function_count + stats->unused_functions;
+    for (size_t f = 0; f < ctx->ast.function_count; f++)
+    {
+        stats->reused_functions += ctx->ast.functions[f].fragment != FRAGMENT_NONE;
+    }
+    stats->instructions = ctx->code.count;
+    stats->name_lookups = ctx->names.lookups;
+    stats->name_probes = ctx->names.probes;
+
+    stats->token_bytes = ctx->token_capacity * sizeof(Token) + sizeof(ctx->token_ring);
+    stats->ast_bytes = ctx->ast.node_capacity * sizeof(Node) + ctx->ast.function_capacity * sizeof(Function) +
+                       ctx->ast.pending_capacity * sizeof(Node);
+    stats->symbol_bytes += ctx->names.slot_capacity * sizeof(uint32_t) +
+                           ctx->names.capacity * (sizeof(const char*) + 2 * sizeof(uint32_t)) + arena_bytes(&ctx->names.storage);
+    stats->code_bytes = ctx->code.capacity * sizeof(Inst) + ctx->codegen.ir.capacity * sizeof(IrInst) +
+                        ctx->codegen.ir.vreg_capacity * sizeof(Interval);
+    stats->output_bytes = ctx->output.capacity + ctx->image.capacity + ctx->label_capacity * sizeof(size_t) +
+                          ctx->fixup_capacity * sizeof(Fixup);
+}
+
+void print_stats(FILE* out, const char* input, const CompileStats* stats, enum StatsFormat format)
+{
+    PhaseTime total = {0, 0};
+    for (int p = 0; p < PHASE_COUNT; p++)
+    {
+        total.wall_ns += stats->phases[p].wall_ns;
+        total.cpu_ns += stats->phases[p].cpu_ns;
+    }
+
+    if (format == STATS_JSON)
+    {
+        fprintf(out, "{\"input\":");
+        print_json_string(out, input);
+        fprintf(out, ",\"cached\":%s,\"phases\":{", stats->cached ? "true" : "false");
+        for (int p = 0; p < PHASE_COUNT; p++)
+        {
+            fprintf(out, "%s\"%s\":{\"wall_ms\":%.3f,\"cpu_ms\":%.3f}", p ? "," : "", phase_names[p],
+                    stats->phases[p].wall_ns / 1e6, stats->phases[p].cpu_ns / 1e6);
+        }
+        fprintf(out, "},\"total\":{\"wall_ms\":%.3f,\"cpu_ms\":%.3f}", total.wall_ns / 1e6, total.cpu_ns / 1e6);
+        fprintf(out, ",\"input_bytes\":%llu,\"tokens\":%llu,\"ast_nodes\":%llu,\"functions\":%llu,\"reused_functions\":%llu",
+                (unsigned long long)stats->input_bytes, (unsigned long long)stats->tokens, (unsigned long long)stats->nodes,
+                (unsigned long long)stats->functions, (unsigned long long)stats->reused_functions);
+        fprintf(out, ",\"unused_functions\":%llu", (unsigned long long)stats->unused_functions);
+        fprintf(out, ",\"instructions\":%llu,\"executable_bytes\":%llu", (unsigned long long)stats->instructions,
+                (unsigned long long)stats->executable_bytes);
+        fprintf(out, ",\"name_lookups\":%llu,\"name_probes\":%llu,\"scope_lookups\":%llu", (unsigned long long)stats->name_lookups,
+                (unsigned long long)stats->name_probes, (unsigned long long)stats->scope_lookups);
+        fprintf(out, ",\"peak_bytes\":{\"tokens\":%llu,\"ast\":%llu,\"symbols\":%llu,\"code\":%llu,\"output\":%llu}}\n",
+                (unsigned long long)stats->token_bytes, (unsigned long long)stats->ast_bytes, (unsigned long long)stats->symbol_bytes,
+                (unsigned long long)stats->code_bytes, (unsigned long long)stats->output_bytes);
+        return;
+    }
+
+    fprintf(out, "%s%s\n", input, stats->cached ? " (cached)" : "");
+    fprintf(out, "  %-12s %10s %10s\n", "phase", "wall ms", "cpu ms");
+    for (int p = 0; p < PHASE_COUNT; p++)
+    {
+        if (stats->phases[p].wall_ns)
+        {
+            fprintf(out, "  %-12s %10.3f %10.3f\n", phase_names[p], stats->phases[p].wall_ns / 1e6, stats->phases[p].cpu_ns / 1e6);
+        }
+    }
+    fprintf(out, "  %-12s %10.3f %10.3f\n", "total", total.wall_ns / 1e6, total.cpu_ns / 1e6);
+    fprintf(out, "  %llu input bytes, %llu tokens, %llu AST nodes\n", (unsigned long long)stats->input_bytes,
+            (unsigned long long)stats->tokens, (unsigned long long)stats->nodes);
+    fprintf(out, "  %llu functions (%llu reused, %llu unused), %llu instructions, %llu executable bytes\n",
+            (unsigned long long)stats->functions, (unsigned long long)stats->reused_functions,
+            (unsigned long long)stats->unused_functions, (unsigned long long)stats->instructions,
+            (unsigned long long)stats->executable_bytes);
+    fprintf(out, "  %llu name lookups (%llu probes), %llu variable lookups\n", (unsigned long long)stats->name_lookups,
+            (unsigned long long)stats->name_probes, (unsigned long long)stats->scope_lookups);
+    char sizes[5][16];
+    fprintf(out, "  peak memory: tokens %s, AST %s, symbols %s, code %s, output %s\n",
+            format_bytes(sizes[0], sizeof(sizes[0]), stats->token_bytes), format_bytes(sizes[1], sizeof(sizes[1]), stats->ast_bytes),
+            format_bytes(sizes[2], sizeof(sizes[2]), stats->symbol_bytes), format_bytes(sizes[3], sizeof(sizes[3]), stats->code_bytes),
+            format_bytes(sizes[4], sizeof(sizes[4]), stats->output_bytes));
+}
+
+void print_json_string(FILE* out, const char* text)
+{
+    fputc('"', out);
+    for (const unsigned char* p = (const unsigned char*)text; *p; p++)
+    {
+        if (*p == '"' || *p == '\\')
+        {
+            fprintf(out, "\\%c", *p);
+        }
+        else if (*p < 0x20)
+        {
+            fprintf(out, "\\u%04x", *p);
+        }
+        else
+        {
+            fputc(*p, out);
+        }
+    }
+    fputc('"', out);
+}
+
+const char* format_bytes(char* buffer, size_t size, uint64_t bytes)
+{
+    if (bytes < 1024)
+    {
+        snprintf(buffer, size, "%llu B", (unsigned long long)bytes);
+    }
+    else if (bytes < 1024 * 1024)
+    {
+        snprintf(buffer, size, "%.1f KiB", bytes / 1024.0);
+    }
+    else
+    {
+        snprintf(buffer, size, "%.1f MiB", bytes / (1024.0 * 1024.0));
+    }
+    return buffer;
+}
+
+int open_trace(Trace* trace, const char* path)
+{
+    trace->file = fopen(path, "w");
+    if (!trace->file)
+    {
+        return -1;
+    }
+    pthread_mutex_init(&trace->lock, NULL);
+    trace->empty = 1;
+    trace->start_ns = clock_ns(CLOCK_MONOTONIC);
+    fputs("[", trace->file);
+    fflush(trace->file);
+    return 0;
+}
+
+void close_trace(Trace* trace)
+{
+    fputs("\n]\n", trace->file);
+    fclose(trace->file);
+    pthread_mutex_destroy(&trace->lock);
+}
+
+// Room for one more event, or NULL. Tracing only observes, so events there
+// is no memory for are dropped rather than failing the compilation.
+TraceEvent* add_trace_event(TraceBuffer* buffer)
+{
+    if (buffer->count == buffer->capacity)
+    {
+        size_t grown = buffer->capacity ? buffer->capacity * 2 : 256;
+        TraceEvent* events = (TraceEvent*)realloc(buffer->events, grown * sizeof(TraceEvent));
+        if (!events)
+        {
+            return NULL;
+        }
+        buffer->events = events;
+        buffer->capacity = grown;
+    }
+    return &buffer->events[buffer->count++];
+}
+
+// Record an event of the buffer's thread lasting from start_ns to end_ns
+void trace_event(TraceBuffer* buffer, const char* name, const char* category, uint64_t start_ns, uint64_t end_ns, uint64_t instructions)
+{
+    TraceEvent* event = add_trace_event(buffer);
+    if (event)
+    {
+        TraceEvent recorded = {name, category, buffer->thread, start_ns, end_ns - start_ns, instructions};
+        *event = recorded;
+    }
+}
+
+// Move the events of a code generation thread over to its context
+void append_trace(TraceBuffer* buffer, const TraceBuffer* events)
+{
+    for (size_t i = 0; i < events->count; i++)
+    {
+        TraceEvent* event = add_trace_event(buffer);
+        if (event)
+        {
+            *event = events->events[i];
+        }
+    }
+}
+
+// Write the events of the compilation that just ended, which started at
+// start_ns, together with one spanning all of it. Names of functions point
+// into the context's name table, so this comes before it is reset.
+void write_trace(CompilerContext* ctx, const CompileUnit* unit, uint64_t start_ns, int status)
+{
+    Trace* trace = ctx->options.trace;
+    uint64_t end_ns = clock_ns(CLOCK_MONOTONIC);
+    pthread_mutex_lock(&trace->lock);
+    FILE* out = trace->file;
+    fprintf(out, "%s\n{\"name\":", trace->empty ? "" : ",");
+    print_json_string(out, unit->input_file ? unit->input_file : "<source>");
+    fprintf(out, ",\"cat\":\"compile\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%ld,\"tid\":%u,\"args\":{\"status\":",
+            (start_ns - trace->start_ns) / 1e3, (end_ns - start_ns) / 1e3, (long)getpid(), ctx->trace.thread);
+    print_json_string(out, status == 0 ? "ok" : ctx->errors.message);
+    fputs("}}", out);
+    trace->empty = 0;
+    for (size_t i = 0; i < ctx->trace.count; i++)
+    {
+        const TraceEvent* event = &ctx->trace.events[i];
+        fputs(",\n{\"name\":", out);
+        print_json_string(out, event->name);
+        fprintf(out, ",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%ld,\"tid\":%u", event->category,
+                (event->start_ns - trace->start_ns) / 1e3, event->duration_ns / 1e3, (long)getpid(), event->thread);
+        if (strcmp(event->category, "function") == 0)
+        {
+            fprintf(out, ",\"args\":{\"instructions\":%llu}", (unsigned long long)event->instructions);
+        }
+        fputs("}", out);
+    }
+    // A trace open in a viewer while the compiler still runs shows whole
+    // compilations
+    fflush(out);
+    pthread_mutex_unlock(&trace->lock);
+    ctx->trace.count = 0;
+}
+
+uint32_t current_thread_id(void)
+{
+    return (uint32_t)syscall(SYS_gettid);
+}
+
+// Read a shape, a comma separated list of key=value pairs, over config.
+// Returns -1 when spec is not one.
+int parse_generator_config(const char* spec, GeneratorConfig* config)
+{
+    while (*spec)
+    {
+        const char* equal = strchr(spec, '=');
+        if (!equal || equal[1] < '0' || equal[1] > '9')
+        {
+            return -1;
+        }
+        size_t length = (size_t)(equal - spec);
+        char* end;
+        errno = 0;
+        unsigned long long value = strtoull(equal + 1, &end, 10);
+        if ((*end != ',' && *end != '\0') || errno != 0)
+        {
+            return -1;
+        }
+
+        uint32_t* field;
+        unsigned long long limit = GENERATOR_MAX_COUNT;
+        if (length == 9 && memcmp(spec, "functions", 9) == 0)
+        {
+            field = &config->functions;
+        }
+        else if (length == 6 && memcmp(spec, "locals", 6) == 0)
+        {
+            field = &config->locals;
+        }
+        else if (length == 10 && memcmp(spec, "statements", 10) == 0)
+        {
+            field = &config->statements;
+        }
+        else if (length == 5 && memcmp(spec, "ident", 5) == 0)
+        {
+            field = &config->ident_length;
+            limit = GENERATOR_MAX_LENGTH;
+        }
+        else if (length == 5 && memcmp(spec, "space", 5) == 0)
+        {
+            field = &config->spacing;
+            limit = GENERATOR_MAX_LENGTH;
+        }
+        else if (length == 4 && memcmp(spec, "seed", 4) == 0)
+        {
+            config->seed = value;
+            field = NULL;
+        }
+        else
+        {
+            return -1;
+        }
+        if (field)
+        {
+            if (value > limit)
+            {
+                return -1;
+            }
+            *field = (uint32_t)value;
+        }
+        spec = *end ? end + 1 : end;
+    }
+    return config->functions > 0 ? 0 : -1;
+}
+
+// The program of a shape in a buffer of its own, or NULL when there is no
+// memory for it
+char* generate_source(const GeneratorConfig* config, size_t* size)
+{
+    ErrorState errors;
+    Emitter e = {0};
+    e.errors = &errors;
+    if (setjmp(errors.jump) != 0)
+    {
+        free(e.data);
+        return NULL;
+    }
+    generate_program(&e, config);
+    *size = e.length;
+    return e.data;
+}
+
+// Functions f0 to fN-2 and then main. Each declares its locals, initialized
+// with a number, an earlier local or a call to an earlier function, follows
+// with assignments and calls and returns one of them, so every name resolves
+// and every input compiles. Calls fan out, so the larger programs are to be
+// compiled rather than run.
+void generate_program(Emitter* e, const GeneratorConfig* config)
+{
+    uint64_t random = config->seed;
+    for (uint32_t f = 0; f < config->functions; f++)
+    {
+        EMIT_LITERAL(e, "int");
+        emit_gap(e, config->spacing, 0, 1);
+        if (f == config->functions - 1)
+        {
+            EMIT_LITERAL(e, "main");
+        }
+        else
+        {
+            emit_generated_name(e, config, 'f', f);
+        }
+        emit_gap(e, config->spacing, 0, 0);
+        EMIT_LITERAL(e, "(");
+        emit_gap(e, config->spacing, 0, 0);
+        EMIT_LITERAL(e, ")");
+        emit_gap(e, config->spacing, 0, 0);
+        EMIT_LITERAL(e, "{");
+
+        for (uint32_t v = 0; v < config->locals; v++)
+        {
+            emit_gap(e, config->spacing, 1, 0);
+            EMIT_LITERAL(e, "int");
+            emit_gap(e, config->spacing, 0, 1);
+            emit_generated_name(e, config, 'v', v);
+            emit_gap(e, config->spacing, 0, 0);
+            EMIT_LITERAL(e, "=");
+            emit_gap(e, config->spacing, 0, 0);
+            emit_generated_value(e, config, &random, f, v);
+            emit_gap(e, config->spacing, 0, 0);
+            EMIT_LITERAL(e, ";");
+        }
+        for (uint32_t s = 0; s < config->statements; s++)
+        {
+            // Without locals there is nothing to assign, and without earlier
+            // functions nothing to call
+            int call = config->locals == 0 || (f > 0 && next_random(&random) % 4 == 0);
+            if (call && f == 0)
+            {
+                break;
+            }
+            emit_gap(e, config->spacing, 1, 0);
+            if (call)
+            {
+                emit_generated_name(e, config, 'f', (uint32_t)(next_random(&random) % f));
+                emit_gap(e, config->spacing, 0, 0);
+                EMIT_LITERAL(e, "(");
+                emit_gap(e, config->spacing, 0, 0);
+                EMIT_LITERAL(e, ")");
+            }
+            else
+            {
+                emit_generated_name(e, config, 'v', (uint32_t)(next_random(&random) % config->locals));
+                emit_gap(e, config->spacing, 0, 0);
+                EMIT_LITERAL(e, "=");
+                emit_gap(e, config->spacing, 0, 0);
+                emit_generated_value(e, config, &random, f, config->locals);
+            }
+            emit_gap(e, config->spacing, 0, 0);
+            EMIT_LITERAL(e, ";");
+        }
+
+        emit_gap(e, config->spacing, 1, 0);
+        EMIT_LITERAL(e, "return");
+        emit_gap(e, config->spacing, 0, 1);
+        if (config->locals > 0)
+        {
+            emit_generated_name(e, config, 'v', (uint32_t)(next_random(&random) % config->locals));
+        }
+        else
+        {
+            emit_int(e, (int)(f % 256));
+        }
+        emit_gap(e, config->spacing, 0, 0);
+        EMIT_LITERAL(e, ";");
+        emit_gap(e, config->spacing, 1, 0);
+        EMIT_LITERAL(e, "}");
+        emit_gap(e, config->spacing, 1, 0);
+    }
+}
+
+// A number, one of the first locals variables or a call to a function
+// before function
+void emit_generated_value(Emitter* e, const GeneratorConfig* config, uint64_t* random, uint32_t function, uint32_t locals)
+{
+    uint64_t choice = next_random(random) % 4;
+    if (choice == 0 && function > 0)
+    {
+        emit_generated_name(e, config, 'f', (uint32_t)(next_random(random) % function));
+        emit_gap(e, config->spacing, 0, 0);
+        EMIT_LITERAL(e, "(");
+        emit_gap(e, config->spacing, 0, 0);
+        EMIT_LITERAL(e, ")");
+    }
+    else if (choice == 1 && locals > 0)
+    {
+        emit_generated_name(e, config, 'v', (uint32_t)(next_random(random) % locals));
+    }
+    else
+    {
+        emit_int(e, (int)(next_random(random) % 1000));
+    }
+}
+
+// The prefix and index, padded with letters to the shape's name length. No
+// keyword starts with a letter followed by a digit.
+void emit_generated_name(Emitter* e, const GeneratorConfig* config, char prefix, uint32_t index)
+{
+    char digits[16];
+    int length = snprintf(digits, sizeof(digits), "%c%u", prefix, index);
+    emit_text(e, digits, (size_t)length);
+    if (config->ident_length > (uint32_t)length)
+    {
+        size_t padding = config->ident_length - (uint32_t)length;
+        emit_reserve(e, padding);
+        for (size_t i = 0; i < padding; i++)
+        {
+            e->data[e->length++] = (char)('a' + (index + i) % 26);
+        }
+    }
+}
+
+// Separate two tokens by spacing white space characters, starting a new line
+// when asked to. Tokens that would run together get at least one.
+void emit_gap(Emitter* e, uint32_t spacing, int newline, int required)
+{
+    uint32_t count = spacing ? spacing : (uint32_t)(newline || required);
+    emit_reserve(e, count);
+    for (uint32_t i = 0; i < count; i++)
+    {
+        e->data[e->length++] = i == 0 && newline ? '\n' : ' ';
+    }
+}
+
+// splitmix64, which is fine with any seed
+uint64_t next_random(uint64_t* state)
+{
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+// Compile the program of each case runs times in memory and report the
+// fastest run of each on stdout. The context is reused for every run, as a
+// server would, so only its first run pays for growing the arrays.
+int run_benchmark(const CompileOptions* options, const GeneratorConfig* cases, size_t case_count, int runs,
+                  enum StatsFormat stats_format)
+{
+    static const enum Phase columns[] = {PHASE_LEX, PHASE_PARSE, PHASE_OPTIMIZE, PHASE_CODEGEN, PHASE_PEEPHOLE, PHASE_OUTPUT};
+    CompilerContext* ctx = (CompilerContext*)malloc(sizeof(CompilerContext));
+    if (!ctx)
+    {
+        fprintf(stderr, "Error: Memory allocation failed for benchmark\n");
+        return 1;
+    }
+    init_context(ctx, options);
+
+    printf("%-12s %10s %9s", "case", "bytes", "functions");
+    for (size_t c = 0; c < sizeof(columns) / sizeof(columns[0]); c++)
+    {
+        printf(" %9s", phase_names[columns[c]]);
+    }
+    printf(" %9s %9s %12s\n", "total ms", "MB/s", "functions/s");
+
+    int status = 0;
+    for (size_t i = 0; i < case_count && status == 0; i++)
+    {
+        size_t size;
+        char* source = generate_source(&cases[i], &size);
+        if (!source)
+        {
+            fprintf(stderr, "Error: Memory allocation failed for benchmark %s\n", cases[i].name);
+            status = 1;
+            break;
+        }
+        CompileUnit unit = {.source = source, .source_size = size, .want_asm = options->emit_asm};
+        CompileStats best;
+        uint64_t best_wall = UINT64_MAX;
+        for (int run = 0; run < runs; run++)
+        {
+            if (compile_unit(ctx, &unit) != 0)
+            {
+                fprintf(stderr, "Error: %s: %s\n", cases[i].name, ctx->errors.message);
+                status = 1;
+                break;
+            }
+            uint64_t wall = 0;
+            for (int p = 0; p < PHASE_COUNT; p++)
+            {
+                wall += ctx->stats.phases[p].wall_ns;
+            }
+            if (wall < best_wall)
+            {
+                best_wall = wall;
+                best = ctx->stats;
+            }
+        }
+        free(source);
+        if (status != 0)
+        {
+            break;
+        }
+
+        double seconds = best_wall ? best_wall / 1e9 : 1e-9;
+        printf("%-12s %10zu %9llu", cases[i].name, size, (unsigned long long)best.functions);
+        for (size_t c = 0; c < sizeof(columns) / sizeof(columns[0]); c++)
+        {
+            printf(" %9.3f", best.phases[columns[c]].wall_ns / 1e6);
+        }
+        printf(" %9.3f %9.1f %12.0f\n", best_wall / 1e6, size / seconds / 1e6, best.functions / seconds);
+        fflush(stdout);
+        if (stats_format != STATS_NONE)
+        {
+            print_stats(stderr, cases[i].name, &best, stats_format);
+        }
+    }
+    free_context(ctx);
+    free(ctx);
+    return status;
+}
+
+// Compile every job, up to workers at a time, recording how each went in the
+// job itself. Returns the number of jobs that failed.
+size_t compile_batch(const CompileOptions* options, BatchJob* jobs, size_t job_count, int workers)
+{
+    Batch batch = {options, jobs, job_count, 0, 0};
+    if ((size_t)workers > job_count)
+    {
+        workers = (int)job_count;
+    }
+
+    // The calling thread works too, and picks up whatever is left should
+    // some threads fail to start
+    pthread_t* threads = workers > 1 ? (pthread_t*)malloc((workers - 1) * sizeof(pthread_t)) : NULL;
+    int started = 0;
+    while (threads && started < workers - 1 && pthread_create(&threads[started], NULL, batch_worker, &batch) == 0)
+    {
+        started++;
+    }
+    batch_worker(&batch);
+    for (int t = 0; t < started; t++)
+    {
+        pthread_join(threads[t], NULL);
+    }
+    free(threads);
+    if (batch.cache_stored)
+    {
+        cache_evict(options);
+    }
+
+    size_t failures = 0;
+    for (size_t i = 0; i < job_count; i++)
+    {
+        failures += jobs[i].status != 0;
+    }
+    return failures;
+}
+
+void* batch_worker(void* arg)
+{
+    Batch* batch = (Batch*)arg;
+    CompilerContext ctx;
+    init_context(&ctx, batch->options);
+    for (;;)
+    {
+        size_t i = __atomic_fetch_add(&batch->next_job, 1, __ATOMIC_RELAXED);
+        if (i >= batch->job_count)
+        {
+            break;
+        }
+        BatchJob* job = &batch->jobs[i];
+        job->status = compile(&ctx, job->input, job->output);
+        if (job->status != 0)
+        {
+            memcpy(job->message, ctx.errors.message, sizeof(job->message));
+            // Without memory for them the message still sums them up
+            job->diagnostics = ctx.diagnostics.length ? strndup(ctx.diagnostics.text, ctx.diagnostics.length) : NULL;
+        }
+        job->stats = ctx.stats;
+    }
+    if (ctx.cache_stored)
+    {
+        __atomic_store_n(&batch->cache_stored, 1, __ATOMIC_RELAXED);
+    }
+    free_context(&ctx);
+    return NULL;
+}
+
+// Serve compile requests on the Unix socket at path until accepting fails.
+// Each of the workers threads accepts connections and compiles with a context
+// of its own, so its buffers stay warm from one request to the next. A
+// connection carries any number of requests, each a line
+//     elf|asm file <path>          compile the file at path, as seen by the server
+//     elf|asm source <size>        compile the size bytes following the line
+// answered with "ok <size>\n" and the executable or assembly, or with
+// "error <message>\n".
+int run_server(const CompileOptions* options, const char* path, int workers)
+{
+    struct sockaddr_un address = {0};
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path))
+    {
+        fprintf(stderr, "Error: Socket path %s is too long\n", path);
+        return 1;
+    }
+    strcpy(address.sun_path, path);
+
+    // Replace a socket left behind by an earlier server, but nothing else
+    struct stat st;
+    if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+    {
+        unlink(path);
+    }
+    Server server = {options, socket(AF_UNIX, SOCK_STREAM, 0)};
+    if (server.fd < 0 || bind(server.fd, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(server.fd, SOMAXCONN) != 0)
+    {
+        fprintf(stderr, "Error: cannot listen on socket %s\n", path);
+        if (server.fd >= 0) close(server.fd);
+        return 1;
+    }
+
+    pthread_t* threads = workers > 1 ? (pthread_t*)malloc((workers - 1) * sizeof(pthread_t)) : NULL;
+    int started = 0;
+    while (threads && started < workers - 1 && pthread_create(&threads[started], NULL, server_worker, &server) == 0)
+    {
+        started++;
+    }
+    server_worker(&server);
+    for (int t = 0; t < started; t++)
+    {
+        pthread_join(threads[t], NULL);
+    }
+    free(threads);
+    close(server.fd);
+    unlink(path);
+    fprintf(stderr, "Error: cannot accept connections on socket %s\n", path);
+    return 1;
+}
+
+void* server_worker(void* arg)
+{
+    Server* server = (Server*)arg;
+    CompilerContext ctx;
+    init_context(&ctx, server->options);
+    ServerConnection connection = {0};
+    for (;;)
+    {
+        int fd = accept(server->fd, NULL, NULL);
+        if (fd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            break;
+        }
+        connection.fd = fd;
+        connection.start = 0;
+        connection.length = 0;
+        serve_connection(&ctx, &connection);
+        close(fd);
+    }
+    free(connection.data);
+    free_context(&ctx);
+    return NULL;
+}
+
+// Answer requests until the client hangs up or sends one that can not be
+// understood, after which the stream can not be trusted
+void serve_connection(CompilerContext* ctx, ServerConnection* connection)
+{
+    for (;;)
+    {
+        char* line = receive_line(connection);
+        if (!line)
+        {
+            return;
+        }
+
+        CompileUnit unit = {0};
+        if (strncmp(line, "asm ", 4) == 0)
+        {
+            unit.want_asm = 1;
+        }
+        else if (strncmp(line, "elf ", 4) != 0)
+        {
+            send_reply(connection->fd, "error Malformed request\n", NULL, 0);
+            return;
+        }
+        line += 4;
+
+        if (strncmp(line, "file ", 5) == 0 && line[5] != '\0' && strcmp(line + 5, "-") != 0)
+        {
+            unit.input_file = line + 5;
+        }
+        else if (strncmp(line, "source ", 7) == 0)
+        {
+            char* end;
+            unsigned long long size = strtoull(line + 7, &end, 10);
+            if (line[7] == '\0' || *end != '\0' || size > SERVER_MAX_SOURCE)
+            {
+                send_reply(connection->fd, "error Malformed request\n", NULL, 0);
+                return;
+            }
+            if (receive_bytes(connection, (size_t)size) != 0)
+            {
+                return;
+            }
+            unit.source = connection->data + connection->start;
+            unit.source_size = (size_t)size;
+            connection->start += (size_t)size;
+        }
+        else
+        {
+            send_reply(connection->fd, "error Malformed request\n", NULL, 0);
+            return;
+        }
+
+        char header[32 + sizeof(ctx->errors.message)];
+        int sent;
+        if (compile_unit(ctx, &unit) == 0)
+        {
+            const Emitter* result = unit.want_asm ? &ctx->output : &ctx->image;
+            snprintf(header, sizeof(header), "ok %zu\n", result->length);
+            sent = send_reply(connection->fd, header, result->data, result->length);
+        }
+        else
+        {
+            snprintf(header, sizeof(header), "error %s\n", ctx->errors.message);
+            sent = send_reply(connection->fd, header, NULL, 0);
+        }
+        if (sent != 0)
+        {
+            return;
+        }
+    }
+}
+
+// Make sure at least size bytes have been received past connection->start.
+// Returns -1 when the client hangs up first.
+int receive_bytes(ServerConnection* connection, size_t size)
+{
+    while (connection->length - connection->start < size)
+    {
+        // Move what is left to the front, then make room for the rest
+        if (connection->start)
+        {
+            memmove(connection->data, connection->data + connection->start, connection->length - connection->start);
+            connection->length -= connection->start;
+            connection->start = 0;
+        }
+        if (connection->capacity - connection->length < SERVER_RECEIVE_SIZE || connection->capacity < size)
+        {
+            size_t capacity = connection->capacity ? connection->capacity : SERVER_RECEIVE_SIZE;
+            while (capacity - connection->length < SERVER_RECEIVE_SIZE || capacity < size) capacity *= 2;
+            char* data = (char*)realloc(connection->data, capacity);
+            if (!data)
+            {
+                return -1;
+            }
+            connection->data = data;
+            connection->capacity = capacity;
+        }
+        ssize_t n = recv(connection->fd, connection->data + connection->length, connection->capacity - connection->length, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0)
+        {
+            return -1;
+        }
+        connection->length += (size_t)n;
+    }
+    return 0;
+}
+
+// Receive the next line and return it without its '\n'. The line stays valid
+// until more is received. Returns NULL when the client hangs up first or the
+// line is unreasonably long.
+char* receive_line(ServerConnection* connection)
+{
+    size_t scanned = 0;
+    for (;;)
+    {
+        char* from = connection->data + connection->start;
+        size_t unscanned = connection->length - connection->start - scanned;
+        char* newline = unscanned ? (char*)memchr(from + scanned, '\n', unscanned) : NULL;
+        if (newline)
+        {
+            *newline = '\0';
+            connection->start = (size_t)(newline + 1 - connection->data);
+            return from;
+        }
+        scanned = connection->length - connection->start;
+        if (scanned >= SERVER_MAX_LINE || receive_bytes(connection, scanned + 1) != 0)
+        {
+            return NULL;
+        }
+    }
+}
+
+// Send header followed by size bytes of data. Returns -1 when the client is
+// gone.
+int send_reply(int fd, const char* header, const char* data, size_t size)
+{
+    const char* parts[2] = {header, data};
+    size_t sizes[2] = {strlen(header), size};
+    for (int i = 0; i < 2; i++)
+    {
+        for (size_t sent = 0; sent < sizes[i];)
+        {
+            ssize_t n = send(fd, parts[i] + sent, sizes[i] - sent, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0)
+            {
+                return -1;
+            }
+            sent += (size_t)n;
+        }
+    }
+    return 0;
+}
+
+void translate_unit(CompilerContext* ctx, const CompileUnit* unit)
+{
+    begin_phase(ctx);
+    if (unit->input_file)
+    {
+        read_input(ctx, unit->input_file);
+    }
+    else
+    {
+        copy_input(ctx, unit->source, unit->source_size);
+    }
+    end_phase(ctx, PHASE_READ);
+
+    // fasm names its output after the source file minus the extension. The
+    // command is built around the path so it can be run as it is.
+    const char* output_file = unit->output_file;
+    const char* asm_path = NULL;
+    if (output_file && (ctx->options.emit_asm || ctx->options.use_fasm))
+    {
+        char* command = (char*)realloc(ctx->asm_path, strlen(output_file) + sizeof("fasm .asm"));
+        if (!command)
+        {
+            fail(&ctx->errors, "Memory allocation failed for output file name");
+        }
+        ctx->asm_path = command;
+        sprintf(command, "fasm %s.asm", output_file);
+        asm_path = command + 5;
+    }
+
+    // Only compilations to files are cached; identical input compiled with
+    // the same options produces the same files
+    CacheKey key = {0, 0};
+    int use_cache = output_file && ctx->options.cache_dir;
+    if (use_cache)
+    {
+        key = cache_key(&ctx->options, ctx->input, ctx->input_size);
+        ctx->stats.cached = cache_fetch(ctx, &key, output_file, asm_path);
+        end_phase(ctx, PHASE_CACHE);
+        if (ctx->stats.cached)
+        {
+            return;
+        }
+    }
+
+    // Functions are reused as they were generated, which at -O2 would miss
+    // changes to the functions inlined into them
+    FragmentTable* fragments = &ctx->fragments;
+    fragments->enabled = ctx->options.incremental && output_file && ctx->options.opt_level < 2;
+    if (ctx->options.streaming && !fragments->enabled)
+    {
+        start_token_stream(ctx);
+    }
+    else
+    {
+        // Fingerprinting looks ahead to the end of each function
+        tokenize(ctx);
+    }
+    end_phase(ctx, PHASE_LEX);
+    if (fragments->enabled)
+    {
+        load_fragments(ctx, output_file);
+        end_phase(ctx, PHASE_FRAGMENTS);
+    }
+    ctx->token_pos = 0;
+    parse_program(ctx);
+    end_phase(ctx, PHASE_PARSE);
+    check_diagnostics(ctx);
+    check_names(ctx);
+    end_phase(ctx, PHASE_PARSE);
+    eliminate_dead_functions(ctx);
+    end_phase(ctx, PHASE_OPTIMIZE);
+    check_diagnostics(ctx);
+    if (ctx->options.opt_level > 0)
+    {
+        optimize_ast(ctx);
+        // Calls the optimizer removed or inlined can leave more functions
+        // uncalled. Dropping them too keeps an incremental build, whose reused
+        // functions were optimized already, identical to a full one.
+        eliminate_dead_functions(ctx);
+        end_phase(ctx, PHASE_OPTIMIZE);
+    }
+
+    generate_code(ctx);
+    end_phase(ctx, PHASE_CODEGEN);
+    check_diagnostics(ctx);
+    if (fragments->enabled)
+    {
+        collect_fragments(ctx);
+        end_phase(ctx, PHASE_FRAGMENTS);
+    }
+    if (ctx->options.opt_level > 0)
+    {
+        peephole(&ctx->code, intern(&ctx->names, "main", 4));
+        end_phase(ctx, PHASE_PEEPHOLE);
+    }
+
+    if (!output_file)
+    {
+        // Kept in memory; fasm is never run for these
+        if (unit->want_asm)
+        {
+            ctx->output.length = 0;
+            print_code(&ctx->output, &ctx->code);
+        }
+        else
+        {
+            build_elf(ctx);
+        }
+        end_phase(ctx, PHASE_OUTPUT);
+        return;
+    }
+
+    if (asm_path)
+    {
+        write_asm(ctx, asm_path);
+        end_phase(ctx, PHASE_OUTPUT);
+    }
+    if (ctx->options.use_fasm)
+    {
+        if (system(ctx->asm_path) != 0)
+        {
+            fail(&ctx->errors, "fasm failed on %s", asm_path);
+        }
+        end_phase(ctx, PHASE_FASM);
+    }
+    else
+    {
+        write_elf(ctx, output_file);
+        end_phase(ctx, PHASE_OUTPUT);
+    }
+    if (use_cache)
+    {
+        cache_store(ctx, &key, output_file, asm_path);
+        end_phase(ctx, PHASE_CACHE);
+    }
+    if (fragments->enabled)
+    {
+        save_fragments(ctx);
+        end_phase(ctx, PHASE_FRAGMENTS);
+    }
+}
+
+// XXH64 of size bytes at data
+uint64_t hash_bytes(const void* data, size_t size, uint64_t seed)
+{
+    const unsigned char* p = (const unsigned char*)data;
+    const unsigned char* end = p + size;
+    uint64_t h;
+    if (size >= 32)
+    {
+        uint64_t v[4] = {seed + HASH_PRIME1 + HASH_PRIME2, seed + HASH_PRIME2, seed, seed - HASH_PRIME1};
+        do
+        {
+            for (int i = 0; i < 4; i++)
+            {
+                uint64_t lane;
+                memcpy(&lane, p, 8);
+                v[i] = hash_round(v[i], lane);
+                p += 8;
+            }
+        } while (end - p >= 32);
+        h = ROTATE_LEFT64(v[0], 1) + ROTATE_LEFT64(v[1], 7) + ROTATE_LEFT64(v[2], 12) + ROTATE_LEFT64(v[3], 18);
+        for (int i = 0; i < 4; i++)
+        {
+            h = (h ^ hash_round(0, v[i])) * HASH_PRIME1 + HASH_PRIME4;
+        }
+    }
+    else
+    {
+        h = seed + HASH_PRIME5;
+    }
+    h += size;
+
+    for (; end - p >= 8; p += 8)
+    {
+        uint64_t lane;
+        memcpy(&lane, p, 8);
+        h = ROTATE_LEFT64(h ^ hash_round(0, lane), 27) * HASH_PRIME1 + HASH_PRIME4;
+    }
+    if (end - p >= 4)
+    {
+        uint32_t lane;
+        memcpy(&lane, p, 4);
+        h = ROTATE_LEFT64(h ^ (lane * HASH_PRIME1), 23) * HASH_PRIME2 + HASH_PRIME3;
+        p += 4;
+    }
+    for (; p < end; p++)
+    {
+        h = ROTATE_LEFT64(h ^ (*p * HASH_PRIME5), 11) * HASH_PRIME1;
+    }
+
+    h ^= h >> 33;
+    h *= HASH_PRIME2;
+    h ^= h >> 29;
+    h *= HASH_PRIME3;
+    h ^= h >> 32;
+    return h;
+}
+
+uint64_t hash_round(uint64_t acc, uint64_t lane)
+{
+    return ROTATE_LEFT64(acc + lane * HASH_PRIME2, 31) * HASH_PRIME1;
+}
+
+// Key the input by everything that decides the output files: the compiler
+// version, the options that change what is written, and the input itself. The
+// check, a second hash under another seed, makes a collision between keys
+// harmless in practice.
+CacheKey cache_key(const CompileOptions* options, const char* input, size_t size)
+{
+    int flags[3] = {options->opt_level, options->emit_asm || options->use_fasm, options->use_fasm};
+    uint64_t seed = hash_bytes(COMPILER_VERSION, sizeof(COMPILER_VERSION) - 1, 0);
+    seed = hash_bytes(flags, sizeof(flags), seed);
+    CacheKey key = {hash_bytes(input, size, seed), hash_bytes(input, size, ~seed)};
+    return key;
+}
+
+// Write the outputs stored under key, if there are any. Returns 1 on a hit,
+// 0 when the input has to be compiled.
+int cache_fetch(CompilerContext* ctx, const CacheKey* key, const char* output_file, const char* asm_path)
+{
+    char path[PATH_MAX];
+    if (snprintf(path, sizeof(path), "%s/%016llx", ctx->options.cache_dir, (unsigned long long)key->name) >= (int)sizeof(path))
+    {
+        return 0;
+    }
+    ctx->cache_length = 0;
+    if (append_file(path, &ctx->cache_buffer, &ctx->cache_capacity, &ctx->cache_length) != 0)
+    {
+        return 0;
+    }
+
+    // Anything unexpected is treated as a miss and replaced afterwards
+    CacheHeader header;
+    if (ctx->cache_length < sizeof(header))
+    {
+        return 0;
+    }
+    memcpy(&header, ctx->cache_buffer, sizeof(header));
+    if (memcmp(header.magic, CACHE_MAGIC, sizeof(header.magic)) != 0 || header.check != key->check ||
+        header.input_size != ctx->input_size || header.elf_size > ctx->cache_length - sizeof(header) ||
+        header.asm_size != ctx->cache_length - sizeof(header) - header.elf_size || (asm_path && header.asm_size == 0))
+    {
+        return 0;
+    }
+
+    const char* elf = ctx->cache_buffer + sizeof(header);
+    if (write_file(output_file, elf, header.elf_size, 0755) != 0)
+    {
+        fail(&ctx->errors, "cannot write output file %s", output_file);
+    }
+    if (asm_path && write_file(asm_path, elf + header.elf_size, header.asm_size, 0666) != 0)
+    {
+        fail(&ctx->errors, "cannot write output file %s", asm_path);
+    }
+    // Eviction goes by modification time, so a hit makes the entry recent
+    utimensat(AT_FDCWD, path, NULL, 0);
+    return 1;
+}
+
+// Store the outputs just written under key. The cache only saves time, so
+// failing to store is not an error.
+void cache_store(CompilerContext* ctx, const CacheKey* key, const char* output_file, const char* asm_path)
+{
+    char path[PATH_MAX];
+    char temp[PATH_MAX + 64];
+    if (snprintf(path, sizeof(path), "%s/%016llx", ctx->options.cache_dir, (unsigned long long)key->name) >= (int)sizeof(path))
+    {
+        return;
+    }
+    // Entries appear complete or not at all, whatever else uses the cache
+    snprintf(temp, sizeof(temp), "%s.%ld.%p.tmp", path, (long)getpid(), (void*)ctx);
+
+    CacheHeader header;
+    memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+    header.check = key->check;
+    header.input_size = ctx->input_size;
+    ctx->cache_length = sizeof(header);
+    if (append_file(output_file, &ctx->cache_buffer, &ctx->cache_capacity, &ctx->cache_length) != 0)
+    {
+        return;
+    }
+    header.elf_size = ctx->cache_length - sizeof(header);
+    if (asm_path && append_file(asm_path, &ctx->cache_buffer, &ctx->cache_capacity, &ctx->cache_length) != 0)
+    {
+        return;
+    }
+    header.asm_size = ctx->cache_length - sizeof(header) - header.elf_size;
+    memcpy(ctx->cache_buffer, &header, sizeof(header));
+
+    if (write_file(temp, ctx->cache_buffer, ctx->cache_length, 0666) != 0)
+    {
+        // The first store creates the directory
+        if (make_directories(ctx->options.cache_dir) != 0 || write_file(temp, ctx->cache_buffer, ctx->cache_length, 0666) != 0)
+        {
+            unlink(temp);
+            return;
+        }
+    }
+    if (rename(temp, path) != 0)
+    {
+        unlink(temp);
+        return;
+    }
+    ctx->cache_stored = 1;
+}
+
+int compare_cache_entry_time(const void* a, const void* b)
+{
+    const CacheEntry* x = (const CacheEntry*)a;
+    const CacheEntry* y = (const CacheEntry*)b;
+    return (x->time > y->time) - (x->time < y->time);
+}
+
+// Least recently used entries go first until the cache is comfortably below
+// its limit, so the next few stores do not each trigger another eviction
+void cache_evict(const CompileOptions* options)
+{
+    DIR* dir = opendir(options->cache_dir);
+    if (!dir)
+    {
+        return;
+    }
+    CacheEntry* entries = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+    uint64_t total = 0;
+    struct dirent* item;
+    while ((item = readdir(dir)) != NULL)
+    {
+        // Only complete entries, named by their 16 hex digit key
+        if (strlen(item->d_name) != 16 || strspn(item->d_name, "0123456789abcdef") != 16)
+        {
+            continue;
+        }
+        struct stat st;
+        if (fstatat(dirfd(dir), item->d_name, &st, 0) != 0 || !S_ISREG(st.st_mode))
+        {
+            continue;
+        }
+        if (count == capacity)
+        {
+            size_t grown = capacity ? capacity * 2 : 256;
+            CacheEntry* grown_entries = (CacheEntry*)realloc(entries, grown * sizeof(CacheEntry));
+            if (!grown_entries)
+            {
+                break;
+            }
+            entries = grown_entries;
+            capacity = grown;
+        }
+        CacheEntry* entry = &entries[count++];
+        entry->time = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+        entry->size = (uint64_t)st.st_size;
+        memcpy(entry->name, item->d_name, sizeof(entry->name));
+        total += entry->size;
+    }
+
+    if (total > options->cache_limit)
+    {
+        qsort(entries, count, sizeof(CacheEntry), compare_cache_entry_time);
+        uint64_t target = options->cache_limit - options->cache_limit / 8;
+        for (size_t i = 0; i < count && total > target; i++)
+        {
+            // Another process may have evicted it already
+            unlinkat(dirfd(dir), entries[i].name, 0);
+            total -= entries[i].size;
+        }
+    }
+    free(entries);
+    closedir(dir);
+}
+
+// Append the contents of the file at path to a growing buffer. Returns -1
+// when it can not be read.
+int append_file(const char* path, char** buffer, size_t* capacity, size_t* length)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+    {
+        close(fd);
+        return -1;
+    }
+    size_t size = (size_t)st.st_size;
+    if (*length + size > *capacity)
+    {
+        char* grown = (char*)realloc(*buffer, *length + size);
+        if (!grown)
+        {
+            close(fd);
+            return -1;
+        }
+        *buffer = grown;
+        *capacity = *length + size;
+    }
+    for (size_t done = 0; done < size;)
+    {
+        ssize_t n = read(fd, *buffer + *length + done, size - done);
+        if (n <= 0)
+        {
+            close(fd);
+            return -1;
+        }
+        done += (size_t)n;
+    }
+    close(fd);
+    *length += size;
+    return 0;
+}
+
+int write_file(const char* path, const char* data, size_t size, mode_t mode)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, mode);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    for (size_t written = 0; written < size;)
+    {
+        ssize_t n = write(fd, data + written, size - written);
+        if (n < 0)
+        {
+            close(fd);
+            return -1;
+        }
+        written += (size_t)n;
+    }
+    return close(fd);
+}
+
+// mkdir -p
+int make_directories(const char* path)
+{
+    char prefix[PATH_MAX];
+    size_t length = strlen(path);
+    if (length >= sizeof(prefix))
+    {
+        return -1;
+    }
+    memcpy(prefix, path, length + 1);
+    for (size_t i = 1; i <= length; i++)
+    {
+        if (prefix[i] == '/' || prefix[i] == '\0')
+        {
+            char c = prefix[i];
+            prefix[i] = '\0';
+            if (mkdir(prefix, 0755) != 0 && errno != EEXIST)
+            {
+                return -1;
+            }
+            prefix[i] = c;
+        }
+    }
+    return 0;
+}
+
+// Load the fragments saved by the previous compilation to output_file. A
+// missing, stale or damaged file leaves the table empty, so that every
+// function is compiled.
+void load_fragments(CompilerContext* ctx, const char* output_file)
+{
+    FragmentTable* table = &ctx->fragments;
+    table->count = 0;
+    table->seed = hash_bytes(COMPILER_VERSION, sizeof(COMPILER_VERSION) - 1, 0);
+    table->seed = hash_bytes(&ctx->options.opt_level, sizeof(ctx->options.opt_level), table->seed);
+    size_t length = strlen(output_file);
+    char* path = (char*)realloc(table->path, length + sizeof(".fragments"));
+    if (!path)
+    {
+        fail(&ctx->errors, "Memory allocation failed for fragment file name");
+    }
+    table->path = path;
+    sprintf(path, "%s.fragments", output_file);
+
+    size_t size = 0;
+    FragmentHeader header;
+    if (append_file(path, &table->data, &table->data_capacity, &size) != 0 || size < sizeof(header))
+    {
+        return;
+    }
+    memcpy(&header, table->data, sizeof(header));
+    if (memcmp(header.magic, FRAGMENT_MAGIC, sizeof(header.magic)) != 0 || header.seed != table->seed)
+    {
+        return;
+    }
+    if (header.name_count > table->name_capacity)
+    {
+        uint32_t* names = (uint32_t*)realloc(table->names, header.name_count * sizeof(uint32_t));
+        if (!names)
+        {
+            fail(&ctx->errors, "Memory allocation failed for fragment table");
+        }
+        table->names = names;
+        table->name_capacity = header.name_count;
+    }
+    if (header.fragment_count > table->capacity)
+    {
+        Fragment* fragments = (Fragment*)realloc(table->fragments, header.fragment_count * sizeof(Fragment));
+        if (!fragments)
+        {
+            fail(&ctx->errors, "Memory allocation failed for fragment table");
+        }
+        table->fragments = fragments;
+        table->capacity = header.fragment_count;
+    }
+
+    size_t at = sizeof(header);
+    for (uint32_t i = 0; i < header.name_count; i++)
+    {
+        uint32_t name_length;
+        if (size - at < sizeof(name_length))
+        {
+            return;
+        }
+        memcpy(&name_length, table->data + at, sizeof(name_length));
+        at += sizeof(name_length);
+        if (name_length == 0 || size - at < name_length)
+        {
+            return;
+        }
+        table->names[i] = intern(&ctx->names, table->data + at, name_length);
+        at += name_length;
+    }
+    for (uint32_t f = 0; f < header.fragment_count; f++)
+    {
+        Fragment* fragment = &table->fragments[f];
+        if (size - at < sizeof(fragment->fingerprint) + sizeof(fragment->count))
+        {
+            return;
+        }
+        memcpy(&fragment->fingerprint, table->data + at, sizeof(fragment->fingerprint));
+        memcpy(&fragment->count, table->data + at + sizeof(fragment->fingerprint), sizeof(fragment->count));
+        at += sizeof(fragment->fingerprint) + sizeof(fragment->count);
+        if ((size - at) / sizeof(FragmentInst) < fragment->count)
+        {
+            return;
+        }
+        fragment->insts = table->data + at;
+        for (uint32_t i = 0; i < fragment->count; i++, at += sizeof(FragmentInst))
+        {
+            FragmentInst inst;
+            memcpy(&inst, table->data + at, sizeof(inst));
+            if (inst.op >= OP_COUNT || inst.dst >= REG_COUNT || inst.src >= REG_COUNT || inst.name > header.name_count)
+            {
+                return;
+            }
+        }
+    }
+    if (at != size)
+    {
+        return;
+    }
+
+    size_t slot_count = 16;
+    while (slot_count < 2 * (size_t)header.fragment_count) slot_count *= 2;
+    if (slot_count > table->slot_capacity)
+    {
+        uint32_t* slots = (uint32_t*)realloc(table->slots, slot_count * sizeof(uint32_t));
+        if (!slots)
+        {
+            fail(&ctx->errors, "Memory allocation failed for fragment table");
+        }
+        table->slots = slots;
+        table->slot_capacity = slot_count;
+    }
+    table->slot_mask = slot_count - 1;
+    memset(table->slots, 0, slot_count * sizeof(uint32_t));
+    for (uint32_t f = 0; f < header.fragment_count; f++)
+    {
+        size_t i = table->fragments[f].fingerprint & table->slot_mask;
+        while (table->slots[i] && table->fragments[table->slots[i] - 1].fingerprint != table->fragments[f].fingerprint)
+        {
+            i = (i + 1) & table->slot_mask;
+        }
+        if (!table->slots[i])
+        {
+            table->slots[i] = f + 1;
+        }
+    }
+    table->count = header.fragment_count;
+}
+
+// Index of the fragment generated for a function with this fingerprint, or
+// FRAGMENT_NONE
+uint32_t find_fragment(const FragmentTable* table, uint64_t fingerprint)
+{
+    if (table->count == 0)
+    {
+        return FRAGMENT_NONE;
+    }
+    for (size_t i = fingerprint & table->slot_mask; table->slots[i]; i = (i + 1) & table->slot_mask)
+    {
+        if (table->fragments[table->slots[i] - 1].fingerprint == fingerprint)
+        {
+            return table->slots[i] - 1;
+        }
+    }
+    return FRAGMENT_NONE;
+}
+
+// Append the instructions of a fragment as the code of its function
+void splice_fragment(CodeGen* cg, const Fragment* fragment)
+{
+    for (uint32_t i = 0; i < fragment->count; i++)
+    {
+        FragmentInst record;
+        memcpy(&record, fragment->insts + i * sizeof(FragmentInst), sizeof(record));
+        Inst* inst = add_inst(cg, (enum Opcode)record.op);
+        inst->dst = record.dst;
+        inst->src = record.src;
+        inst->imm = record.imm;
+        inst->name = record.name ? cg->fragments->names[record.name - 1] : NAME_NONE;
+    }
+}
+
+// Lay out the fragment file for the code just generated, one fragment per
+// function. It is only written by save_fragments() once the compilation has
+// succeeded; until then the previous one stays in place.
+void collect_fragments(CompilerContext* ctx)
+{
+    FragmentTable* table = &ctx->fragments;
+    const Code* code = &ctx->code;
+    const Ast* ast = &ctx->ast;
+    Emitter* file = &table->file;
+    file->length = 0;
+    if (ctx->names.count > table->file_name_capacity)
+    {
+        uint32_t* file_names = (uint32_t*)realloc(table->file_names, ctx->names.count * sizeof(uint32_t));
+        if (!file_names)
+        {
+            fail(&ctx->errors, "Memory allocation failed for fragment table");
+        }
+        table->file_names = file_names;
+        table->file_name_capacity = ctx->names.count;
+    }
+    memset(table->file_names, 0, ctx->names.count * sizeof(uint32_t));
+
+    // Each function starts with its label, and the start stub follows them
+    size_t end = 0;
+    for (uint32_t labels = 0; end < code->count; end++)
+    {
+        if (code->insts[end].op == OP_LABEL && labels++ == ast->function_count)
+        {
+            break;
+        }
+    }
+
+    FragmentHeader header = {FRAGMENT_MAGIC, table->seed, 0, ast->function_count};
+    emit_text(file, (const char*)&header, sizeof(header));
+    for (size_t i = 0; i < end; i++)
+    {
+        uint32_t name = code->insts[i].name;
+        if (name != NAME_NONE && !table->file_names[name])
+        {
+            table->file_names[name] = ++header.name_count;
+            uint32_t length = ctx->names.lengths[name];
+            emit_text(file, (const char*)&length, sizeof(length));
+            emit_text(file, name_text(&ctx->names, name), length);
+        }
+    }
+    size_t i = 0;
+    for (uint32_t f = 0; f < ast->function_count; f++)
+    {
+        size_t start = i++;
+        while (i < end && code->insts[i].op != OP_LABEL) i++;
+        uint32_t count = (uint32_t)(i - start);
+        emit_text(file, (const char*)&ast->functions[f].fingerprint, sizeof(uint64_t));
+        emit_text(file, (const char*)&count, sizeof(count));
+        for (size_t k = start; k < i; k++)
+        {
+            const Inst* inst = &code->insts[k];
+            FragmentInst record = {inst->op, inst->dst, inst->src, 0, inst->imm, inst->name ? table->file_names[inst->name] : 0};
+            emit_text(file, (const char*)&record, sizeof(record));
+        }
+    }
+    memcpy(file->data, &header, sizeof(header));
+}
+
+// Replace the fragment file with the one collected. Like the cache it only
+// saves time, so failing to write it is not an error.
+void save_fragments(CompilerContext* ctx)
+{
+    FragmentTable* table = &ctx->fragments;
+    char temp[PATH_MAX];
+    if (snprintf(temp, sizeof(temp), "%s.tmp", table->path) >= (int)sizeof(temp))
+    {
+        return;
+    }
+    if (write_file(temp, table->file.data, table->file.length, 0666) != 0 || rename(temp, table->path) != 0)
+    {
+        unlink(temp);
+    }
+}
+
+// Index of the '}' closing the function starting at the current token, or
+// SIZE_MAX when it is not a well-formed function definition
+size_t function_end(const CompilerContext* ctx)
+{
+    size_t i = ctx->token_pos;
+    if (ctx->tokens[i].type != TOK_INT || ctx->tokens[i + 1].type != TOK_IDENTIFIER)
+    {
+        return SIZE_MAX;
+    }
+    int depth = 0;
+    for (i += 2; ctx->tokens[i].type != TOK_EOF; i++)
+    {
+        if (ctx->tokens[i].type == TOK_LBRACE)
+        {
+            depth++;
+        }
+        else if (ctx->tokens[i].type == TOK_RBRACE && --depth <= 0)
+        {
+            return depth == 0 ? i : SIZE_MAX;
+        }
+    }
+    return SIZE_MAX;
+}
+
+void read_input(CompilerContext* ctx, const char* filename)
+{
+    int fd = strcmp(filename, "-") == 0 ? STDIN_FILENO : open(filename, O_RDONLY);
+    if (fd < 0)
+    {
+        fail(&ctx->errors, "cannot open input file %s", filename);
+    }
+    if (fd != STDIN_FILENO) ctx->input_fd = fd; // Closed by compile() should reading fail
+
+    // Regular files are scanned straight out of the page cache, anything else
+    // (pipes, terminals, stdin) is read into a growing heap buffer
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0 || !map_input(ctx, fd, st.st_size))
+    {
+        read_input_stream(ctx, fd, filename);
+    }
+
+    if (fd != STDIN_FILENO) close(fd);
+    ctx->input_fd = -1;
+}
+
+int map_input(CompilerContext* ctx, int fd, size_t size)
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t length = (size + 1 + page - 1) & ~(page - 1);
+
+    // Reserve one byte more than the file so the lexer always finds the '\0'
+    // sentinel: the tail of the last file page is zero-filled by the kernel, and
+    // when the file ends exactly on a page boundary the extra anonymous page is
+    char* region = mmap(NULL, length, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (region == MAP_FAILED) return 0;
+
+    if (mmap(region, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED)
+    {
+        munmap(region, length);
+        return 0;
+    }
+    madvise(region, length, MADV_SEQUENTIAL);
+
+    ctx->input = region;
+    ctx->input_size = size;
+    ctx->input_mapping = length;
+    return 1;
+}
+
+void read_input_stream(CompilerContext* ctx, int fd, const char* filename)
+{
+    // The buffer is the context's input from the start, so compile() frees it
+    // should reading fail
+    size_t capacity = 64 * 1024;
+    size_t size = 0;
+    char* buffer = (char*)malloc(capacity);
+    if (!buffer)
+    {
+        fail(&ctx->errors, "Memory allocation failed for input buffer");
+    }
+    ctx->input = buffer;
+    ctx->input_mapping = 0;
+
+    while (1)
+    {
+        // Keep room for the sentinel
+        if (size + 1 >= capacity)
+        {
+            capacity *= 2;
+            buffer = (char*)realloc(buffer, capacity);
+            if (!buffer)
+            {
+                fail(&ctx->errors, "Memory allocation failed for input buffer");
+            }
+            ctx->input = buffer;
+        }
+        ssize_t n = read(fd, buffer + size, capacity - size - 1);
+        if (n == 0) break;
+        if (n < 0)
+        {
+            fail(&ctx->errors, "cannot read input file %s", filename);
+        }
+        size += (size_t)n;
+    }
+    buffer[size] = '\0';
+    ctx->input_size = size;
+}
+
+// Compile from a copy of size bytes at source
+void copy_input(CompilerContext* ctx, const char* source, size_t size)
+{
+    char* buffer = (char*)malloc(size + 1);
+    if (!buffer)
+    {
+        fail(&ctx->errors, "Memory allocation failed for input buffer");
+    }
+    memcpy(buffer, source, size);
+    buffer[size] = '\0';
+    ctx->input = buffer;
+    ctx->input_size = size;
+    ctx->input_mapping = 0;
+}
+
+void free_input(CompilerContext* ctx)
+{
+    if (ctx->input_mapping)
+    {
+        munmap((void*)ctx->input, ctx->input_mapping);
+    }
+    else
+    {
+        free((void*)ctx->input);
+    }
+    ctx->input = NULL;
+    ctx->input_size = 0;
+    ctx->input_mapping = 0;
+    if (ctx->input_fd >= 0)
+    {
+        close(ctx->input_fd);
+        ctx->input_fd = -1;
+    }
+}
+
+// The token array is kept for the next compilation
+void tokenize(CompilerContext* ctx)
+{
+    ctx->token_stream = 0;
+    size_t chunk_count = ctx->options.threads > 1 ? ctx->input_size / LEX_CHUNK_MIN_SIZE : 0;
+    if (chunk_count > 1)
+    {
+        tokenize_parallel(ctx, chunk_count < (size_t)ctx->options.threads ? chunk_count : (size_t)ctx->options.threads);
+        return;
+    }
+    ctx->token_count = 0;
+    ctx->pos = 0;
+    while (1)
+    {
+        if (ctx->token_count == ctx->token_capacity)
+        {
+            ctx->tokens = (Token*)grow_array(&ctx->errors, ctx->tokens, &ctx->token_capacity, sizeof(Token));
+        }
+        Token token = next_token(ctx);
+        ctx->tokens[ctx->token_count++] = token;
+        if (token.type == TOK_EOF) break;
+    }
+}
+
+// Lex chunks of the input concurrently and stitch their tokens together in
+// order. The names of each chunk are interned in the context's table in the
+// order the chunk first uses them, which is the order a serial run would
+// intern them in, so the tokens come out exactly as tokenize() makes them.
+void tokenize_parallel(CompilerContext* ctx, size_t chunk_count)
+{
+    if (chunk_count > ctx->lex_chunk_capacity)
+    {
+        LexChunk* chunks = (LexChunk*)realloc(ctx->lex_chunks, chunk_count * sizeof(LexChunk));
+        if (!chunks)
+        {
+            fail(&ctx->errors, "Memory allocation failed for lexer chunks");
+        }
+        memset(chunks + ctx->lex_chunk_capacity, 0, (chunk_count - ctx->lex_chunk_capacity) * sizeof(LexChunk));
+        ctx->lex_chunks = chunks;
+        ctx->lex_chunk_capacity = chunk_count;
+    }
+    LexChunk* chunks = ctx->lex_chunks;
+    size_t start = 0;
+    for (size_t c = 0; c < chunk_count; c++)
+    {
+        LexChunk* chunk = &chunks[c];
+        size_t end = c + 1 < chunk_count ? ctx->input_size / chunk_count * (c + 1) : ctx->input_size;
+        chunk->input = ctx->input;
+        chunk->start = start;
+        chunk->end = start = lex_boundary(ctx->input, end > start ? end : start, ctx->input_size);
+        chunk->token_count = 0;
+        chunk->table = c > 0 ? &chunk->names : &ctx->names;
+        reset_names(&chunk->names);
+        chunk->names.errors = &chunk->errors;
+        chunk->tracing = ctx->options.trace != NULL;
+        chunk->trace.count = 0;
+        chunk->failed = 0;
+    }
+
+    // The first chunk borrows the context's arrays. Until all chunks are done,
+    // running out of memory in it must not unwind the compilation under the
+    // others.
+    chunks[0].tokens = ctx->tokens;
+    chunks[0].token_capacity = ctx->token_capacity;
+    ctx->names.errors = &chunks[0].errors;
+    ctx->stats.phases[PHASE_LEX].cpu_ns += run_workers(chunks, sizeof(LexChunk), chunk_count, lex_chunk);
+    ctx->names.errors = &ctx->errors;
+    ctx->tokens = chunks[0].tokens;
+    ctx->token_capacity = chunks[0].token_capacity;
+    chunks[0].tokens = NULL;
+    chunks[0].token_capacity = 0;
+
+    for (size_t c = 0; c < chunk_count; c++)
+    {
+        append_trace(&ctx->trace, &chunks[c].trace);
+        if (chunks[c].failed)
+        {
+            fail(&ctx->errors, "%s", chunks[c].errors.message);
+        }
+    }
+    size_t total = chunks[0].token_count;
+    for (size_t c = 1; c < chunk_count; c++)
+    {
+        LexChunk* chunk = &chunks[c];
+        // Tokens without a name keep NAME_NONE, which is always id 0
+        size_t id_count = chunk->names.count ? chunk->names.count : 1;
+        if (id_count > chunk->id_capacity)
+        {
+            uint32_t* ids = (uint32_t*)realloc(chunk->ids, id_count * sizeof(uint32_t));
+            if (!ids)
+            {
+                fail(&ctx->errors, "Memory allocation failed for lexer chunks");
+            }
+            chunk->ids = ids;
+            chunk->id_capacity = id_count;
+        }
+        chunk->ids[NAME_NONE] = NAME_NONE;
+        for (size_t id = 1; id < chunk->names.count; id++)
+        {
+            chunk->ids[id] = intern(&ctx->names, chunk->names.text[id], chunk->names.lengths[id]);
+        }
+        ctx->names.lookups += chunk->names.lookups;
+        ctx->names.probes += chunk->names.probes;
+        total += chunk->token_count;
+    }
+
+    // The chunks lex no TOK_EOF; the array ends with the one lexing the whole
+    // input would
+    if (total + 1 > ctx->token_capacity)
+    {
+        Token* tokens = (Token*)realloc(ctx->tokens, (total + 1) * sizeof(Token));
+        if (!tokens)
+        {
+            fail(&ctx->errors, "Memory allocation failed for tokens");
+        }
+        ctx->tokens = tokens;
+        ctx->token_capacity = total + 1;
+    }
+    Token* out = ctx->tokens + chunks[0].token_count;
+    for (size_t c = 1; c < chunk_count; c++)
+    {
+        chunks[c].out = out;
+        out += chunks[c].token_count;
+    }
+    ctx->stats.phases[PHASE_LEX].cpu_ns += run_workers(chunks + 1, sizeof(LexChunk), chunk_count - 1, stitch_chunk);
+    Token eof = {TOK_EOF, 0, ctx->input_size, NAME_NONE};
+    *out = eof;
+    ctx->token_count = total + 1;
+    ctx->pos = ctx->input_size;
+}
+
+// First offset at or after from that follows whitespace, ';' or '}', and so
+// can not be inside a token, or end
+size_t lex_boundary(const char* input, size_t from, size_t end)
+{
+    while (from > 0 && from < end)
+    {
+        unsigned char c = (unsigned char)input[from - 1];
+        if ((char_class[c] & CC_SPACE) || c == ';' || c == '}')
+        {
+            break;
+        }
+        from++;
+    }
+    return from;
+}
+
+// Run worker on each of count items starting with a WorkerThread, each on a
+// thread of its own but the first, which the calling thread runs along with
+// any whose thread fails to start. Returns the CPU time of the other threads;
+// the caller's own is in its phase already.
+uint64_t run_workers(void* items, size_t item_size, size_t count, void* (*worker)(void*))
+{
+    uint64_t cpu_ns = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        WorkerThread* thread = (WorkerThread*)((char*)items + i * item_size);
+        thread->started = i > 0 && pthread_create(&thread->thread, NULL, worker, thread) == 0;
+    }
+    worker(items);
+    for (size_t i = 1; i < count; i++)
+    {
+        WorkerThread* thread = (WorkerThread*)((char*)items + i * item_size);
+        if (thread->started)
+        {
+            pthread_join(thread->thread, NULL);
+            cpu_ns += thread->cpu_ns;
+        }
+        else
+        {
+            worker(thread);
+        }
+    }
+    return cpu_ns;
+}
+
+void* lex_chunk(void* arg)
+{
+    LexChunk* chunk = (LexChunk*)arg;
+    uint64_t start_ns = clock_ns(CLOCK_MONOTONIC);
+    uint64_t start_cpu = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+    if (setjmp(chunk->errors.jump) == 0)
+    {
+        size_t pos = chunk->start;
+        while (1)
+        {
+            Token token = lex_token(chunk->input, &pos, chunk->end, chunk->table);
+            if (token.type == TOK_EOF) break;
+            if (chunk->token_count == chunk->token_capacity)
+            {
+                chunk->tokens = (Token*)grow_array(&chunk->errors, chunk->tokens, &chunk->token_capacity, sizeof(Token));
+            }
+            chunk->tokens[chunk->token_count++] = token;
+        }
+    }
+    else
+    {
+        chunk->failed = 1;
+    }
+    if (chunk->tracing)
+    {
+        chunk->trace.thread = current_thread_id();
+        trace_event(&chunk->trace, "lex chunk", "chunk", start_ns, clock_ns(CLOCK_MONOTONIC), 0);
+    }
+    chunk->worker.cpu_ns = clock_ns(CLOCK_THREAD_CPUTIME_ID) - start_cpu;
+    return NULL;
+}
+
+// Copy the chunk's tokens to their place, with their names renumbered
+void* stitch_chunk(void* arg)
+{
+    LexChunk* chunk = (LexChunk*)arg;
+    uint64_t start_cpu = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+    for (size_t i = 0; i < chunk->token_count; i++)
+    {
+        Token token = chunk->tokens[i];
+        token.name = chunk->ids[token.name];
+        chunk->out[i] = token;
+    }
+    chunk->worker.cpu_ns = clock_ns(CLOCK_THREAD_CPUTIME_ID) - start_cpu;
+    return NULL;
+}
+
+void free_lex_chunk(LexChunk* chunk)
+{
+    free(chunk->tokens);
+    free_names(&chunk->names);
+    free(chunk->ids);
+    free(chunk->trace.events);
+}
+
+void start_token_stream(CompilerContext* ctx)
+{
+    ctx->token_stream = 1;
+    ctx->token_count = 0;
+    ctx->pos = 0;
+}
+
+// Token `ahead` positions past token_pos. Past the end of input this is the
+// TOK_EOF token, so callers never need to bounds-check their lookahead.
+Token* peek_token(CompilerContext* ctx, size_t ahead)
+{
+    size_t index = ctx->token_pos + ahead;
+    if (!ctx->token_stream)
+    {
+        return &ctx->tokens[index < ctx->token_count ? index : ctx->token_count - 1];
+    }
+
+    // next_token() keeps returning TOK_EOF at the end of input, so the ring
+    // can be refilled unconditionally
+    while (ctx->token_count <= index)
+    {
+        ctx->token_ring[ctx->token_count & (TOKEN_RING_SIZE - 1)] = next_token(ctx);
+        ctx->token_count++;
+    }
+    return &ctx->token_ring[index & (TOKEN_RING_SIZE - 1)];
+}
+
+void advance_token(CompilerContext* ctx)
+{
+    ctx->token_pos++;
+}
+
+// Run scanners: each returns the offset of the first byte in [from, end) that
+// does not belong to the run, or end. The scalar versions are the reference
+// the vector versions must agree with; the vector versions fall back to them
+// for the tail that does not fill a whole vector.
+size_t skip_space_scalar(const char* text, size_t from, size_t end)
+{
+    while (from < end && (char_class[(unsigned char)text[from]] & CC_SPACE)) from++;
+    return from;
+}
+
+size_t scan_ident_scalar(const char* text, size_t from, size_t end)
+{
+    while (from < end && (char_class[(unsigned char)text[from]] & CC_IDENT)) from++;
+    return from;
+}
+
+#if defined(__x86_64__)
+// Signed byte compares are enough: bytes >= 0x80 are negative and fall
+// outside every ASCII range tested here
+static inline __m128i sse2_in_range(__m128i v, char lo, char hi)
+{
+    return _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(lo - 1)), _mm_cmplt_epi8(v, _mm_set1_epi8(hi + 1)));
+}
+
+static inline __m128i sse2_is_space(__m128i v)
+{
+    return _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), sse2_in_range(v, '\t', '\r'));
+}
+
+static inline __m128i sse2_is_ident(__m128i v)
+{
+    // Folding to lower case maps only letters into 'a'..'z'
+    __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+    return _mm_or_si128(_mm_or_si128(sse2_in_range(lower, 'a', 'z'), sse2_in_range(v, '0', '9')),
+                        _mm_cmpeq_epi8(v, _mm_set1_epi8('_')));
+}
+
+static size_t skip_space_sse2(const char* text, size_t from, size_t end)
+{
+    for (; from + 16 <= end; from += 16)
+    {
+        unsigned mask = (unsigned)_mm_movemask_epi8(sse2_is_space(_mm_loadu_si128((const __m128i*)&text[from])));
+        if (mask != 0xFFFF) return from + __builtin_ctz(~mask);
+    }
+    return skip_space_scalar(text, from, end);
+}
+
+static size_t scan_ident_sse2(const char* text, size_t from, size_t end)
+{
+    for (; from + 16 <= end; from += 16)
+    {
+        unsigned mask = (unsigned)_mm_movemask_epi8(sse2_is_ident(_mm_loadu_si128((const __m128i*)&text[from])));
+        if (mask != 0xFFFF) return from + __builtin_ctz(~mask);
+    }
+    return scan_ident_scalar(text, from, end);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i avx2_in_range(__m256i v, char lo, char hi)
+{
+    return _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8(lo - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8(hi + 1), v));
+}
+
+__attribute__((target("avx2")))
+static size_t skip_space_avx2(const char* text, size_t from, size_t end)
+{
+    for (; from + 32 <= end; from += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i*)&text[from]);
+        __m256i space = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')), avx2_in_range(v, '\t', '\r'));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(space);
+        if (mask != 0xFFFFFFFFu) return from + __builtin_ctz(~mask);
+    }
+    return skip_space_sse2(text, from, end);
+}
+
+__attribute__((target("avx2")))
+static size_t scan_ident_avx2(const char* text, size_t from, size_t end)
+{
+    for (; from + 32 <= end; from += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i*)&text[from]);
+        __m256i lower = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+        __m256i ident = _mm256_or_si256(_mm256_or_si256(avx2_in_range(lower, 'a', 'z'), avx2_in_range(v, '0', '9')),
+                                        _mm256_cmpeq_epi8(v, _mm256_set1_epi8('_')));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(ident);
+        if (mask != 0xFFFFFFFFu) return from + __builtin_ctz(~mask);
+    }
+    return scan_ident_sse2(text, from, end);
+}
+#elif defined(__aarch64__)
+// Offset of the first zero byte in a 0x00/0xFF comparison result, or 16. The
+// narrowing shift packs each byte into a nibble of a 64-bit scalar.
+static inline unsigned neon_first_clear(uint8x16_t match)
+{
+    uint64_t bits = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(match), 4)), 0);
+    return ~bits ? (unsigned)__builtin_ctzll(~bits) >> 2 : 16;
+}
+
+static size_t skip_space_neon(const char* text, size_t from, size_t end)
+{
+    for (; from + 16 <= end; from += 16)
+    {
+        uint8x16_t v = vld1q_u8((const uint8_t*)&text[from]);
+        uint8x16_t space = vorrq_u8(vceqq_u8(v, vdupq_n_u8(' ')), vcleq_u8(vsubq_u8(v, vdupq_n_u8('\t')), vdupq_n_u8('\r' - '\t')));
+        unsigned first = neon_first_clear(space);
+        if (first < 16) return from + first;
+    }
+    return skip_space_scalar(text, from, end);
+}
+
+static size_t scan_ident_neon(const char* text, size_t from, size_t end)
+{
+    for (; from + 16 <= end; from += 16)
+    {
+        uint8x16_t v = vld1q_u8((const uint8_t*)&text[from]);
+        uint8x16_t lower = vorrq_u8(v, vdupq_n_u8(0x20));
+        uint8x16_t ident = vorrq_u8(vorrq_u8(vcleq_u8(vsubq_u8(lower, vdupq_n_u8('a')), vdupq_n_u8('z' - 'a')),
+                                             vcleq_u8(vsubq_u8(v, vdupq_n_u8('0')), vdupq_n_u8('9' - '0'))),
+                                    vceqq_u8(v, vdupq_n_u8('_')));
+        unsigned first = neon_first_clear(ident);
+        if (first < 16) return from + first;
+    }
+    return scan_ident_scalar(text, from, end);
+}
+#endif
+
+// Pick the widest scanners the CPU supports. SSE2 is part of the x86-64
+// baseline and NEON of AArch64, so only AVX2 needs a runtime check.
+void select_scanners(int allow_simd)
+{
+    skip_space = skip_space_scalar;
+    scan_ident = scan_ident_scalar;
+    if (!allow_simd) return;
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        skip_space = skip_space_avx2;
+        scan_ident = scan_ident_avx2;
+    }
+    else
+    {
+        skip_space = skip_space_sse2;
+        scan_ident = scan_ident_sse2;
+    }
+#elif defined(__aarch64__)
+    skip_space = skip_space_neon;
+    scan_ident = scan_ident_neon;
+#endif
+}
+
+// Lexer: Get next token
+Token next_token(CompilerContext* ctx)
+{
+    return lex_token(ctx->input, &ctx->pos, ctx->input_size, &ctx->names);
+}
+
+// Token at *pos in input[0, end), interning identifiers in names. Anything
+// that starts no token is a TOK_UNKNOWN of one byte for the parser to report.
+Token lex_token(const char* input, size_t* pos, size_t end, InternTable* names)
+{
+    Token token = {TOK_UNKNOWN, 0, 0, NAME_NONE};
+    size_t at = skip_space(input, *pos, end);
+
+    token.start = at;
+    if (at >= end)
+    {
+        *pos = at;
+        token.type = TOK_EOF;
+        return token;
+    }
+
+    unsigned char c = (unsigned char)input[at];
+    if (char_class[c] & CC_ALPHA)
+    {
+        at = scan_ident(input, at + 1, end);
+        size_t len = at - token.start;
+        const Keyword* keyword = &keyword_table[KEYWORD_HASH(c, input[token.start + 1], len)];
+        if (keyword->length == len && memcmp(keyword->name, &input[token.start], len) == 0)
+        {
+            token.type = keyword->type;
+        }
+        else
+        {
+            token.type = TOK_IDENTIFIER;
+            token.name = intern(names, &input[token.start], len);
+        }
+    }
+    else if (char_class[c] & CC_DIGIT)
+    {
+        while (char_class[(unsigned char)input[at]] & CC_DIGIT)
+        {
+            at++;
+        }
+        token.type = TOK_NUMBER;
+    }
+    else
+    {
+        switch (c)
+        {
+            case ';': token.type = TOK_SEMICOLON; break;
+            case '{': token.type = TOK_LBRACE; break;
+            case '}': token.type = TOK_RBRACE; break;
+            case '(': token.type = TOK_LPAREN; break;
+            case ')': token.type = TOK_RPAREN; break;
+            case '=': token.type = TOK_EQUAL; break;
+            default: token.type = TOK_UNKNOWN; break;
+        }
+        at++;
+    }
+
+    *pos = at;
+    token.length = (unsigned int)(at - token.start);
+    return token;
+}
+
+// Decimal value of a TOK_NUMBER lexeme, read straight from the input span
+int token_number(CompilerContext* ctx, const Token* token)
+{
+    unsigned int value = 0;
+    for (unsigned int i = 0; i < token->length; i++)
+    {
+        value = value * 10 + (unsigned int)(ctx->input[token->start + i] - '0');
+    }
+    return (int)value;
+}
+
+// Region allocator: allocations are bump-allocated out of large blocks and
+// released all at once, so there is no per-object free
+void* arena_alloc(ErrorState* errors, Arena* arena, size_t size)
+{
+    size = (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+    ArenaBlock* block = arena->head;
+    if (!block || block->capacity - block->used < size)
+    {
+        // Blocks double in size so large inputs need few of them
+        size_t capacity = block ? block->capacity * 2 : ARENA_BLOCK_SIZE;
+        if (capacity > ARENA_MAX_BLOCK_SIZE) capacity = ARENA_MAX_BLOCK_SIZE;
+        if (capacity < size) capacity = size;
+        block = (ArenaBlock*)malloc(sizeof(ArenaBlock) + capacity);
+        if (!block)
+        {
+            fail(errors, "Memory allocation failed for arena block");
+        }
+        block->next = arena->head;
+        block->used = 0;
+        block->capacity = capacity;
+        arena->head = block;
+    }
+    void* result = block->data + block->used;
+    block->used += size;
+    return result;
+}
+
+char* arena_strndup(ErrorState* errors, Arena* arena, const char* text, size_t length)
+{
+    char* copy = (char*)arena_alloc(errors, arena, length + 1);
+    memcpy(copy, text, length);
+    copy[length] = '\0';
+    return copy;
+}
+
+// Release everything but the newest (largest) block, which is kept for reuse
+void arena_reset(Arena* arena)
+{
+    ArenaBlock* block = arena->head;
+    if (!block) return;
+    ArenaBlock* rest = block->next;
+    while (rest)
+    {
+        ArenaBlock* next = rest->next;
+        free(rest);
+        rest = next;
+    }
+    block->next = NULL;
+    block->used = 0;
+}
+
+void arena_free(Arena* arena)
+{
+    arena_reset(arena);
+    free(arena->head);
+    arena->head = NULL;
+}
+
+// Bytes held by the arena's blocks
+size_t arena_bytes(const Arena* arena)
+{
+    size_t bytes = 0;
+    for (const ArenaBlock* block = arena->head; block; block = block->next)
+    {
+        bytes += sizeof(ArenaBlock) + block->capacity;
+    }
+    return bytes;
+}
+
+// FNV-1a, used to place names in the intern table
+uint32_t hash_name(const char* text, size_t length)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++)
+    {
+        hash = (hash ^ (unsigned char)text[i]) * 16777619u;
+    }
+    return hash;
+}
+
+// Id of the name spelled by text, adding it on first sight. Ids are dense,
+// in order of first occurrence, and start at 1; NAME_NONE (0) is never issued.
+uint32_t intern(InternTable* names, const char* text, size_t length)
+{
+    if (names->count == 0)
+    {
+        names->count = 1; // Reserve NAME_NONE
+    }
+    if (2 * (names->count + 1) > names->slot_capacity)
+    {
+        // Double the slot table once it is half full
+        size_t capacity = names->slot_capacity ? names->slot_capacity * 2 : INTERN_INITIAL_CAPACITY;
+        uint32_t* slots = (uint32_t*)calloc(capacity, sizeof(uint32_t));
+        if (!slots)
+        {
+            fail(names->errors, "Memory allocation failed for intern table");
+        }
+        for (size_t id = 1; id < names->count; id++)
+        {
+            size_t i = names->hashes[id] & (capacity - 1);
+            while (slots[i]) i = (i + 1) & (capacity - 1);
+            slots[i] = (uint32_t)id;
+        }
+        free(names->slots);
+        names->slots = slots;
+        names->slot_capacity = capacity;
+    }
+
+    uint32_t hash = hash_name(text, length);
+    size_t mask = names->slot_capacity - 1;
+    size_t i = hash & mask;
+    names->lookups++;
+    for (; names->slots[i]; i = (i + 1) & mask)
+    {
+        names->probes++;
+        uint32_t id = names->slots[i];
+        if (names->hashes[id] == hash && names->lengths[id] == length && memcmp(names->text[id], text, length) == 0)
+        {
+            return id;
+        }
+    }
+
+    if (names->count >= names->capacity)
+    {
+        // An array that grew is kept even if another could not, so that the
+        // table stays as it was should one of them fail
+        size_t capacity = names->capacity ? names->capacity * 2 : INTERN_INITIAL_CAPACITY;
+        const char** text = (const char**)realloc(names->text, capacity * sizeof(const char*));
+        names->text = text ? text : names->text;
+        uint32_t* hashes = (uint32_t*)realloc(names->hashes, capacity * sizeof(uint32_t));
+        names->hashes = hashes ? hashes : names->hashes;
+        uint32_t* lengths = (uint32_t*)realloc(names->lengths, capacity * sizeof(uint32_t));
+        names->lengths = lengths ? lengths : names->lengths;
+        if (!text || !hashes || !lengths)
+        {
+            fail(names->errors, "Memory allocation failed for intern table");
+        }
+        names->capacity = capacity;
+    }
+    uint32_t id = (uint32_t)names->count++;
+    names->text[id] = arena_strndup(names->errors, &names->storage, text, length);
+    names->hashes[id] = hash;
+    names->lengths[id] = (uint32_t)length;
+    names->slots[i] = id;
+    return id;
+}
+
+const char* name_text(const InternTable* names, uint32_t id)
+{
+    return names->text[id];
+}
+
+// Forget all names but keep the tables for the next compilation
+void reset_names(InternTable* names)
+{
+    if (names->slots)
+    {
+        memset(names->slots, 0, names->slot_capacity * sizeof(uint32_t));
+    }
+    names->count = 0;
+    names->lookups = 0;
+    names->probes = 0;
+    arena_reset(&names->storage);
+}
+
+void free_names(InternTable* names)
+{
+    free(names->slots);
+    free(names->text);
+    free(names->hashes);
+    free(names->lengths);
+    arena_free(&names->storage);
+}
+
+// Open a block scope nested in the current one
+void push_scope(CodeGen* cg)
+{
+    Scope* scope = (Scope*)malloc(sizeof(Scope));
+    if (!scope)
+    {
+        fail(cg->errors, "Memory allocation failed for scope");
+    }
+    scope->parent = cg->scope;
+    scope->capacity = SCOPE_INITIAL_CAPACITY;
+    scope->symbols = (Symbol*)calloc(scope->capacity, sizeof(Symbol));
+    if (!scope->symbols)
+    {
+        free(scope);
+        fail(cg->errors, "Memory allocation failed for symbol table");
+    }
+    scope->symbol_count = 0;
+    cg->scope = scope;
+    track_symbol_bytes(cg, sizeof(Scope) + scope->capacity * sizeof(Symbol));
+}
+
+void track_symbol_bytes(CodeGen* cg, size_t bytes)
+{
+    cg->symbol_bytes += bytes;
+    if (cg->symbol_bytes > cg->peak_symbol_bytes)
+    {
+        cg->peak_symbol_bytes = cg->symbol_bytes;
+    }
+}
+
+// Close the innermost scope
+void pop_scope(CodeGen* cg)
+{
+    Scope* scope = cg->scope;
+    cg->scope = scope->parent;
+    cg->symbol_bytes -= sizeof(Scope) + scope->capacity * sizeof(Symbol);
+    free(scope->symbols);
+    free(scope);
+}
+
+// Slot holding name in scope, or the empty slot where it would be inserted.
+// Ids are dense, so a multiplicative hash spreads them evenly.
+Symbol* find_symbol(const Scope* scope, uint32_t name)
+{
+    size_t mask = scope->capacity - 1;
+    for (size_t i = (name * 2654435761u) & mask;; i = (i + 1) & mask)
+    {
+        Symbol* symbol = &scope->symbols[i];
+        if (symbol->name == name || symbol->name == NAME_NONE)
+        {
+            return symbol;
+        }
+    }
+}
+
+// Double the table once it is half full
+void grow_scope(ErrorState* errors, Scope* scope)
+{
+    Symbol* old = scope->symbols;
+    size_t old_capacity = scope->capacity;
+    scope->capacity *= 2;
+    scope->symbols = (Symbol*)calloc(scope->capacity, sizeof(Symbol));
+    if (!scope->symbols)
+    {
+        fail(errors, "Memory allocation failed for symbol table");
+    }
+    for (size_t i = 0; i < old_capacity; i++)
+    {
+        if (old[i].name != NAME_NONE)
+        {
+            *find_symbol(scope, old[i].name) = old[i];
+        }
+    }
+    free(old);
+}
+
+// Declare the variable of a declaration node
+Symbol* add_variable(CodeGen* cg, const Node* decl)
+{
+    // Check for duplicate variable; shadowing one of an enclosing scope is fine
+    uint32_t name = decl->name;
+    Symbol* symbol = find_symbol(cg->scope, name);
+    if (symbol->name != NAME_NONE)
+    {
+        fail_at(cg->errors, node_location(decl), "Variable %s already exists", name_text(cg->names, name));
+    }
+
+    if (2 * (cg->scope->symbol_count + 1) > cg->scope->capacity)
+    {
+        track_symbol_bytes(cg, cg->scope->capacity * sizeof(Symbol));
+        grow_scope(cg->errors, cg->scope);
+        symbol = find_symbol(cg->scope, name);
+    }
+    cg->scope->symbol_count++;
+    symbol->name = name;
+    symbol->stack_offset = 0;
+    symbol->vreg = VREG_NONE;
+    return symbol;
+}
+
+// Innermost visible variable called name, NULL if there is none
+Symbol* lookup_variable(CodeGen* cg, uint32_t name)
+{
+    cg->scope_lookups++;
+    for (const Scope* scope = cg->scope; scope; scope = scope->parent)
+    {
+        Symbol* symbol = find_symbol(scope, name);
+        if (symbol->name != NAME_NONE)
+        {
+            return symbol;
+        }
+    }
+    return NULL;
+}
+
+// Variable a node refers to, which must be visible
+Symbol* use_variable(CodeGen* cg, const Node* node)
+{
+    Symbol* symbol = lookup_variable(cg, node->name);
+    if (!symbol)
+    {
+        fail_at(cg->errors, node_location(node), "Undefined variable %s", name_text(cg->names, node->name));
+    }
+    return symbol;
+}
+
+// Keep only main and the functions it calls, directly or through others, so
+// that the rest are neither optimized nor generated, and report every call to
+// a function defined nowhere and every definition of a function after its
+// first. Both are checked in all functions, called or not, like their
+// variables by check_names(). Functions reused from the previous compilation
+// call what their fragment does. The functions kept stay in source order.
+void eliminate_dead_functions(CompilerContext* ctx)
+{
+    Ast* ast = &ctx->ast;
+    const FragmentTable* table = &ctx->fragments;
+    uint32_t main_name = intern(&ctx->names, "main", 4);
+    size_t name_count = ctx->names.count;
+    size_t function_count = ast->function_count;
+    uint32_t* function_of = (uint32_t*)malloc(name_count * sizeof(uint32_t)); // First definition of each name
+    uint32_t* next = (uint32_t*)malloc((function_count + 1) * sizeof(uint32_t)); // Next definition of the same name
+    uint32_t* stack = (uint32_t*)malloc((function_count + 1) * sizeof(uint32_t));
+    uint8_t* reachable = (uint8_t*)calloc(function_count + 1, 1);
+    if (!function_of || !next || !stack || !reachable)
+    {
+        free(reachable);
+        free(stack);
+        free(next);
+        free(function_of);
+        fail(&ctx->errors, "Memory allocation failed for call graph");
+    }
+    for (size_t i = 0; i < name_count; i++)
+    {
+        function_of[i] = FUNCTION_NONE;
+    }
+    for (size_t f = function_count; f-- > 0;)
+    {
+        uint32_t name = ast->functions[f].name;
+        next[f] = function_of[name];
+        function_of[name] = (uint32_t)f;
+    }
+
+    Diagnostics* diagnostics = &ctx->diagnostics;
+    for (size_t f = 0; f < function_count && diagnostics->count < DIAGNOSTICS_MAX; f++)
+    {
+        const Function* func = &ast->functions[f];
+        if (function_of[func->name] != f)
+        {
+            char message[sizeof(ctx->errors.message)];
+            snprintf(message, sizeof(message), "Function %s is defined more than once", name_text(&ctx->names, func->name));
+            report_error(ctx, func->offset == NODE_NO_OFFSET ? SIZE_MAX : func->offset, message);
+        }
+        if (func->fragment == FRAGMENT_NONE)
+        {
+            for (uint32_t i = 0; i < func->stmt_count && diagnostics->count < DIAGNOSTICS_MAX; i++)
+            {
+                const Node* call = stmt_call(ast, &ast->nodes[func->first_stmt + i]);
+                if (call && function_of[call->name] == FUNCTION_NONE)
+                {
+                    report_undefined_function(ctx, node_location(call), call->name);
+                }
+            }
+        }
+        else
+        {
+            // The calls of a function not parsed are only known to be in it
+            const Fragment* fragment = &table->fragments[func->fragment];
+            for (uint32_t i = 0; i < fragment->count && diagnostics->count < DIAGNOSTICS_MAX; i++)
+            {
+                uint32_t name = fragment_call(table, fragment, i);
+                if (name != NAME_NONE && function_of[name] == FUNCTION_NONE)
+                {
+                    report_undefined_function(ctx, func->offset == NODE_NO_OFFSET ? SIZE_MAX : func->offset, name);
+                }
+            }
+        }
+    }
+    if (function_of[main_name] == FUNCTION_NONE && diagnostics->count < DIAGNOSTICS_MAX)
+    {
+        report_error(ctx, SIZE_MAX, "Undefined function main");
+    }
+
+    // Depth-first from main, marking functions as they are found
+    size_t depth = 0;
+    for (uint32_t f = function_of[main_name]; f != FUNCTION_NONE; f = next[f])
+    {
+        reachable[f] = 1;
+        stack[depth++] = f;
+    }
+    while (depth > 0)
+    {
+        const Function* func = &ast->functions[stack[--depth]];
+        uint32_t count = func->fragment == FRAGMENT_NONE ? func->stmt_count : table->fragments[func->fragment].count;
+        for (uint32_t i = 0; i < count; i++)
+        {
+            uint32_t name = NAME_NONE;
+            if (func->fragment == FRAGMENT_NONE)
+            {
+                const Node* call = stmt_call(ast, &ast->nodes[func->first_stmt + i]);
+                name = call ? call->name : NAME_NONE;
+            }
+            else
+            {
+                name = fragment_call(table, &table->fragments[func->fragment], i);
+            }
+            for (uint32_t callee = name != NAME_NONE ? function_of[name] : FUNCTION_NONE; callee != FUNCTION_NONE; callee = next[callee])
+            {
+                if (!reachable[callee])
+                {
+                    reachable[callee] = 1;
+                    stack[depth++] = callee;
+                }
+            }
+        }
+    }
+
+    size_t kept = 0;
+    for (size_t f = 0; f < function_count; f++)
+    {
+        if (reachable[f])
+        {
+            ast->functions[kept++] = ast->functions[f];
+        }
+    }
+    ctx->stats.unused_functions += function_count - kept;
+    ast->function_count = kept;
+
+    free(reachable);
+    free(stack);
+    free(next);
+    free(function_of);
+    if (diagnostics->count >= DIAGNOSTICS_MAX)
+    {
+        fail(&ctx->errors, "Too many errors, giving up");
+    }
+}
+
+void report_undefined_function(CompilerContext* ctx, size_t offset, uint32_t name)
+{
+    char message[sizeof(ctx->errors.message)];
+    snprintf(message, sizeof(message), "Undefined function %s", name_text(&ctx->names, name));
+    report_error(ctx, offset, message);
+}
+
+// The call a statement makes, directly or in its operand, or NULL
+const Node* stmt_call(const Ast* ast, const Node* stmt)
+{
+    if (stmt->type == NODE_CALL)
+    {
+        return stmt;
+    }
+    if (stmt->child != NODE_NONE && ast->nodes[stmt->child].type == NODE_CALL)
+    {
+        return &ast->nodes[stmt->child];
+    }
+    return NULL;
+}
+
+// Name called by instruction i of a fragment, or NAME_NONE
+uint32_t fragment_call(const FragmentTable* table, const Fragment* fragment, uint32_t i)
+{
+    FragmentInst record;
+    memcpy(&record, fragment->insts + i * sizeof(FragmentInst), sizeof(record));
+    return record.op == OP_CALL && record.name ? table->names[record.name - 1] : NAME_NONE;
+}
+
+// Report the variables misused in each function, as code generation at -O0
+// would: the first one in each function, with the same message. Every
+// function parsed is checked, called or not. Functions main never calls are
+// not generated and the optimizer removes statements, so neither may pass
+// over an error unreported.
+void check_names(CompilerContext* ctx)
+{
+    const Ast* ast = &ctx->ast;
+    uint32_t* declared = (uint32_t*)calloc(ctx->names.count, sizeof(uint32_t)); // Function declaring it + 1
+    if (!declared)
+    {
+        fail(&ctx->errors, "Memory allocation failed for name check");
+    }
+    Diagnostics* diagnostics = &ctx->diagnostics;
+    for (size_t f = 0; f < ast->function_count && diagnostics->count < DIAGNOSTICS_MAX; f++)
+    {
+        // Reused code was checked when it was generated
+        if (ast->functions[f].fragment != FRAGMENT_NONE)
+        {
+            continue;
+        }
+        const Node* node = check_function(ast, &ast->functions[f], declared, (uint32_t)f + 1);
+        if (node)
+        {
+            char message[sizeof(ctx->errors.message)];
+            const char* name = name_text(&ctx->names, node->name);
+            if (node->type == NODE_VAR_DECL)
+            {
+                snprintf(message, sizeof(message), "Variable %s already exists", name);
+            }
+            else
+            {
+                snprintf(message, sizeof(message), "Undefined variable %s", name);
+            }
+            report_error(ctx, node_location(node), message);
+        }
+    }
+    free(declared);
+    if (diagnostics->count >= DIAGNOSTICS_MAX)
+    {
+        fail(&ctx->errors, "Too many errors, giving up");
+    }
+}
+
+// The first node of func that misuses a variable, in the order the -O0 code
+// generation meets them: a declaration of one already declared, or a
+// reference or an assignment to one not declared yet. NULL if there is none.
+// declared[name] is epoch for the variables func has declared so far.
+const Node* check_function(const Ast* ast, const Function* func, uint32_t* declared, uint32_t epoch)
+{
+    const Node* body = &ast->nodes[func->first_stmt];
+    for (uint32_t i = 0; i < func->stmt_count; i++)
+    {
+        const Node* stmt = &body[i];
+        const Node* value = stmt->child != NODE_NONE ? &ast->nodes[stmt->child] : NULL;
+        if (stmt->type == NODE_VAR_DECL)
+        {
+            if (declared[stmt->name] == epoch)
+            {
+                return stmt;
+            }
+            declared[stmt->name] = epoch;
+        }
+        if (value && value->type == NODE_VAR_REF && declared[value->name] != epoch)
+        {
+            return value;
+        }
+        if (stmt->type == NODE_VAR_ASSIGN && declared[stmt->name] != epoch)
+        {
+            return stmt;
+        }
+    }
+    return NULL;
+}
+
+// Run the AST optimizations over every function: constant propagation and
+// dead code removal from -O1, inlining from -O2. Functions are visited in
+// post-order of the call graph so that callees are already simplified, and
+// their final bodies are what gets inlined.
+void optimize_ast(CompilerContext* ctx)
+{
+    Ast* ast = &ctx->ast;
+    size_t name_count = ctx->names.count;
+    Optimizer opt;
+    opt.facts = (VarFact*)calloc(name_count, sizeof(VarFact));
+    opt.function_of = (uint32_t*)malloc(name_count * sizeof(uint32_t));
+    opt.state = (uint8_t*)calloc(ast->function_count + 1, 1);
+    opt.inlinable = (uint8_t*)calloc(ast->function_count + 1, 1);
+    CallFrame* stack = (CallFrame*)malloc((ast->function_count + 1) * sizeof(CallFrame));
+    if (!opt.facts || !opt.function_of || !opt.state || !opt.inlinable || !stack)
+    {
+        free(stack);
+        free(opt.inlinable);
+        free(opt.state);
+        free(opt.function_of);
+        free(opt.facts);
+        fail(&ctx->errors, "Memory allocation failed for optimizer");
+    }
+    for (size_t i = 0; i < name_count; i++)
+    {
+        opt.function_of[i] = FUNCTION_NONE;
+    }
+    for (size_t f = 0; f < ast->function_count; f++)
+    {
+        uint32_t name = ast->functions[f].name;
+        opt.function_of[name] = opt.function_of[name] == FUNCTION_NONE ? (uint32_t)f : FUNCTION_DUPLICATE;
+    }
+
+    // Iterative depth-first walk; a callee found active is a recursive call
+    for (uint32_t root = 0; root < ast->function_count; root++)
+    {
+        if (opt.state[root] != FUNC_UNVISITED)
+        {
+            continue;
+        }
+        size_t depth = 0;
+        stack[depth++] = (CallFrame){root, 0};
+        opt.state[root] = FUNC_ACTIVE;
+        while (depth > 0)
+        {
+            CallFrame* top = &stack[depth - 1];
+            const Function* func = &ast->functions[top->func];
+            if (top->next < func->stmt_count)
+            {
+                uint32_t callee = stmt_callee(ast, &opt, &ast->nodes[func->first_stmt + top->next++]);
+                if (callee < ast->function_count && opt.state[callee] == FUNC_UNVISITED)
+                {
+                    opt.state[callee] = FUNC_ACTIVE;
+                    stack[depth++] = (CallFrame){callee, 0};
+                }
+                continue;
+            }
+
+            uint32_t f = top->func;
+            if (ctx->options.opt_level >= 2)
+            {
+                inline_calls(ast, &opt, f);
+            }
+            optimize_function(ast, &ast->functions[f], opt.facts, f + 1);
+            opt.inlinable[f] = is_inlinable(ast, &opt, f);
+            opt.state[f] = FUNC_DONE;
+            depth--;
+        }
+    }
+
+    free(stack);
+    free(opt.inlinable);
+    free(opt.state);
+    free(opt.function_of);
+    free(opt.facts);
+}
+
+// Index of the function a statement calls, directly or in its operand;
+// FUNCTION_NONE if it calls nothing or FUNCTION_DUPLICATE
+uint32_t stmt_callee(const Ast* ast, const Optimizer* opt, const Node* stmt)
+{
+    const Node* call = stmt_call(ast, stmt);
+    return call ? opt->function_of[call->name] : FUNCTION_NONE;
+}
+
+// A function is inlined when its optimized body is a few calls followed by
+// returning a number or a call, none of them to a function still being
+// visited (which would make it recursive)
+int is_inlinable(const Ast* ast, const Optimizer* opt, uint32_t f)
+{
+    const Function* func = &ast->functions[f];
+    if (func->stmt_count == 0 || func->stmt_count > INLINE_MAX_STMTS)
+    {
+        return 0;
+    }
+    const Node* body = &ast->nodes[func->first_stmt];
+    const Node* ret = &body[func->stmt_count - 1];
+    if (ret->type != NODE_RETURN || ast->nodes[ret->child].type == NODE_VAR_REF)
+    {
+        return 0;
+    }
+    for (uint32_t i = 0; i < func->stmt_count; i++)
+    {
+        if (i + 1 < func->stmt_count && body[i].type != NODE_CALL)
+        {
+            return 0;
+        }
+        uint32_t callee = stmt_callee(ast, opt, &body[i]);
+        if (callee < ast->function_count && opt->state[callee] == FUNC_ACTIVE)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Replace calls to inlinable functions in f with the callee's calls and result
+void inline_calls(Ast* ast, const Optimizer* opt, uint32_t f)
+{
+    Function* func = &ast->functions[f];
+    size_t base = ast->pending_count;
+    int changed = 0;
+    for (uint32_t i = 0; i < func->stmt_count; i++)
+    {
+        Node stmt = ast->nodes[func->first_stmt + i];
+        uint32_t callee = stmt_callee(ast, opt, &stmt);
+        if (callee >= ast->function_count || !opt->inlinable[callee])
+        {
+            push_pending(ast, stmt);
+            continue;
+        }
+
+        const Function* inlined = &ast->functions[callee];
+        const Node* inlined_body = &ast->nodes[inlined->first_stmt];
+        for (uint32_t j = 0; j + 1 < inlined->stmt_count; j++)
+        {
+            push_pending(ast, inlined_body[j]);
+        }
+        const Node* result = &ast->nodes[inlined_body[inlined->stmt_count - 1].child];
+        if (stmt.type != NODE_CALL)
+        {
+            ast->nodes[stmt.child] = *result; // Operand nodes are never shared
+            push_pending(ast, stmt);
+        }
+        else if (result->type == NODE_CALL)
+        {
+            push_pending(ast, *result);
+        }
+        changed = 1;
+    }
+
+    // The body is rewritten in place unless it grew
+    uint32_t count = (uint32_t)(ast->pending_count - base);
+    if (changed)
+    {
+        if (count > func->stmt_count)
+        {
+            func->first_stmt = (uint32_t)ast->node_count;
+            for (size_t i = base; i < ast->pending_count; i++)
+            {
+                add_node(ast, ast->pending[i]);
+            }
+        }
+        else
+        {
+            memcpy(&ast->nodes[func->first_stmt], &ast->pending[base], count * sizeof(Node));
+        }
+        func->stmt_count = count;
+    }
+    ast->pending_count = base;
+}
+
+// Fact about name in the function being optimized, NULL if it is not declared
+VarFact* find_fact(VarFact* facts, uint32_t epoch, uint32_t name)
+{
+    return facts[name].epoch == epoch ? &facts[name] : NULL;
+}
+
+// Replace a reference to a variable of known value with the value
+void propagate_value(Node* value, VarFact* facts, uint32_t epoch)
+{
+    if (value->type == NODE_VAR_REF)
+    {
+        const VarFact* fact = find_fact(facts, epoch, value->name);
+        if (fact->known)
+        {
+            *value = (Node){.type = NODE_NUMBER, .child = NODE_NONE, .value = fact->value, .offset = value->offset};
+        }
+    }
+}
+
+// Record what a store of value leaves in fact
+void store_value(VarFact* fact, const Node* value)
+{
+    fact->known = value->type == NODE_NUMBER;
+    fact->value = value->value;
+}
+
+// Constant propagation, dead-store elimination and removal of statements
+// after a return. Bodies are straight-line, so one forward and one backward
+// walk are exact. A function using undefined or duplicate variables is left
+// for the code generator to report.
+void optimize_function(Ast* ast, Function* func, VarFact* facts, uint32_t epoch)
+{
+    Node* body = &ast->nodes[func->first_stmt];
+    for (uint32_t i = 0; i < func->stmt_count; i++)
+    {
+        if (body[i].type == NODE_RETURN)
+        {
+            func->stmt_count = i + 1;
+            break;
+        }
+    }
+
+    // Forward: fold variables of known value into their uses
+    for (uint32_t i = 0; i < func->stmt_count; i++)
+    {
+        Node* stmt = &body[i];
+        Node* value = stmt->child != NODE_NONE ? &ast->nodes[stmt->child] : NULL;
+        if (value && value->type == NODE_VAR_REF && !find_fact(facts, epoch, value->name))
+        {
+            return;
+        }
+        if (value)
+        {
+            propagate_value(value, facts, epoch);
+        }
+        if (stmt->type == NODE_VAR_DECL)
+        {
+            if (find_fact(facts, epoch, stmt->name))
+            {
+                return;
+            }
+            VarFact* fact = &facts[stmt->name];
+            memset(fact, 0, sizeof(VarFact));
+            fact->epoch = epoch;
+            if (value)
+            {
+                store_value(fact, value);
+            }
+        }
+        else if (stmt->type == NODE_VAR_ASSIGN)
+        {
+            VarFact* fact = find_fact(facts, epoch, stmt->name);
+            if (!fact)
+            {
+                return;
+            }
+            store_value(fact, value);
+        }
+    }
+
+    // Backward: drop stores nothing reads and declarations nothing mentions,
+    // keeping any call they contain. Kept statements are packed towards the
+    // end of the range.
+    uint32_t out = func->stmt_count;
+    for (uint32_t i = func->stmt_count; i-- > 0;)
+    {
+        Node stmt = body[i];
+        const Node* value = stmt.child != NODE_NONE ? &ast->nodes[stmt.child] : NULL;
+        if (stmt.type == NODE_VAR_DECL || stmt.type == NODE_VAR_ASSIGN)
+        {
+            VarFact* fact = &facts[stmt.name];
+            int mentioned = fact->referenced;
+            if (value && !fact->live)
+            {
+                if (value->type != NODE_CALL)
+                {
+                    stmt.child = NODE_NONE;
+                    value = NULL;
+                }
+                else if (stmt.type == NODE_VAR_ASSIGN || !mentioned)
+                {
+                    stmt = (Node){.type = NODE_CALL, .child = NODE_NONE, .name = value->name, .offset = value->offset};
+                    value = NULL;
+                }
+                // A declaration still needed keeps its call initializer
+            }
+            if (stmt.type == NODE_VAR_ASSIGN && !value)
+            {
+                continue;
+            }
+            if (stmt.type == NODE_VAR_DECL && !value && !mentioned)
+            {
+                continue;
+            }
+            if (stmt.type != NODE_CALL)
+            {
+                fact->live = 0;
+                fact->referenced = 1;
+            }
+        }
+        if (value && value->type == NODE_VAR_REF)
+        {
+            facts[value->name].live = 1;
+            facts[value->name].referenced = 1;
+        }
+        body[--out] = stmt;
+    }
+    func->first_stmt += out;
+    func->stmt_count -= out;
+}
+
+void generate_code(CompilerContext* ctx)
+{
+    const Ast* ast = &ctx->ast;
+    CodeGen* cg = &ctx->codegen;
+    cg->code = &ctx->code;
+    cg->names = &ctx->names;
+    cg->fragments = &ctx->fragments;
+    cg->opt_level = ctx->options.opt_level;
+    cg->errors = &ctx->errors;
+    cg->scope_lookups = 0;
+    cg->peak_symbol_bytes = 0;
+    cg->trace = ctx->options.trace ? &ctx->trace : NULL;
+    cg->failure_count = 0;
+    if (ctx->options.threads > 1 && ast->function_count > CODEGEN_BATCH_SIZE)
+    {
+        generate_parallel(ctx);
+    }
+    else
+    {
+        // Errors in the program are caught function by function
+        ErrorState errors;
+        cg->errors = &errors;
+        int failed = gen_functions(cg, ast, 0, ast->function_count);
+        cg->errors = &ctx->errors;
+        if (failed)
+        {
+            fail(&ctx->errors, "%s", errors.message);
+        }
+    }
+    for (size_t i = 0; i < cg->failure_count; i++)
+    {
+        report_error(ctx, cg->failures[i].offset, cg->failures[i].message);
+    }
+    if (cg->failure_count >= DIAGNOSTICS_MAX)
+    {
+        fail(&ctx->errors, "Too many errors, giving up");
+    }
+
+    ctx->stats.scope_lookups += cg->scope_lookups;
+    ctx->stats.symbol_bytes += cg->peak_symbol_bytes;
+
+    gen_label(cg, intern(&ctx->names, "start", 5));
+    gen_call(cg, intern(&ctx->names, "main", 4));
+    gen_mov(cg, REG_RDI, REG_RAX);
+    gen_mov_imm(cg, REG_RAX, 60); // sys_exit
+    gen_op(cg, OP_SYSCALL);
+}
+
+void gen_function(CodeGen* cg, const Ast* ast, const Function* func)
+{
+    uint64_t start_ns = cg->trace ? clock_ns(CLOCK_MONOTONIC) : 0;
+    size_t first = cg->code->count;
+    if (func->fragment != FRAGMENT_NONE)
+    {
+        splice_fragment(cg, &cg->fragments->fragments[func->fragment]);
+    }
+    else if (cg->opt_level > 0)
+    {
+        gen_function_regalloc(cg, ast, func);
+    }
+    else
+    {
+        gen_function_stack(cg, ast, func);
+    }
+    if (cg->trace)
+    {
+        trace_event(cg->trace, name_text(cg->names, func->name), "function", start_ns, clock_ns(CLOCK_MONOTONIC),
+                    cg->code->count - first);
+    }
+}
+
+// Generate functions [first, end) into cg->code. A function in error is
+// recorded in cg->failures and the next one generated, so that every function
+// is checked in one run. Returns -1, with the reason in cg->errors, should
+// anything else fail.
+int gen_functions(CodeGen* cg, const Ast* ast, size_t first, size_t end)
+{
+    volatile size_t f = first; // Advanced after setjmp(), so must survive a longjmp()
+    if (setjmp(cg->errors->jump) != 0)
+    {
+        unwind_codegen(cg);
+        if (cg->errors->offset == SIZE_MAX)
+        {
+            return -1;
+        }
+        if (cg->failure_count < DIAGNOSTICS_MAX)
+        {
+            if (cg->failure_count == cg->failure_capacity)
+            {
+                cg->failures = (CodegenFailure*)grow_array(cg->errors, cg->failures, &cg->failure_capacity, sizeof(CodegenFailure));
+            }
+            CodegenFailure* failure = &cg->failures[cg->failure_count++];
+            failure->function = (uint32_t)f;
+            failure->offset = cg->errors->offset;
+            memcpy(failure->message, cg->errors->message, sizeof(failure->message));
+        }
+        f++;
+    }
+    for (; f < end; f++)
+    {
+        gen_function(cg, ast, &ast->functions[f]);
+    }
+    return 0;
+}
+
+int compare_codegen_failures(const void* a, const void* b)
+{
+    const CodegenFailure* x = (const CodegenFailure*)a;
+    const CodegenFailure* y = (const CodegenFailure*)b;
+    return (x->function > y->function) - (x->function < y->function);
+}
+
+void free_codegen(CodeGen* cg)
+{
+    unwind_codegen(cg);
+    free(cg->failures);
+    free(cg->ir.insts);
+    free(cg->ir.intervals);
+    free(cg->frame.vars);
+    free(cg->frame.free_slots);
+}
+
+// Drop the scopes of a function whose generation failed
+void unwind_codegen(CodeGen* cg)
+{
+    while (cg->scope)
+    {
+        pop_scope(cg);
+    }
+}
+
+// Functions share nothing but the read-only AST and name table, so batches of
+// them are generated on worker threads into lists of their own, which are
+// appended in source order afterwards. Should several fail, the error of the
+// first in source order is reported, as a serial run would.
+void generate_parallel(CompilerContext* ctx)
+{
+    const Ast* ast = &ctx->ast;
+    int threads = ctx->options.threads;
+    CodegenJob job = {.ast = ast, .error_batch = SIZE_MAX};
+    job.batch_count = (ast->function_count + CODEGEN_BATCH_SIZE - 1) / CODEGEN_BATCH_SIZE;
+    job.batches = (Code*)calloc(job.batch_count, sizeof(Code));
+    CodegenWorker* workers = (CodegenWorker*)calloc(threads, sizeof(CodegenWorker));
+    if (!job.batches || !workers)
+    {
+        free(workers);
+        free(job.batches);
+        fail(&ctx->errors, "Memory allocation failed for code generation");
+    }
+    pthread_mutex_init(&job.error_lock, NULL);
+    for (int t = 0; t < threads; t++)
+    {
+        workers[t].job = &job;
+        workers[t].cg.names = &ctx->names;
+        workers[t].cg.fragments = &ctx->fragments;
+        workers[t].cg.opt_level = ctx->options.opt_level;
+        workers[t].cg.errors = &workers[t].errors;
+        workers[t].cg.trace = ctx->options.trace ? &workers[t].trace : NULL;
+    }
+
+    // The calling thread works too, and picks up whatever is left should
+    // some threads fail to start
+    int started = 1;
+    while (started < threads && pthread_create(&workers[started].thread, NULL, codegen_worker, &workers[started]) == 0)
+    {
+        started++;
+    }
+    codegen_worker(&workers[0]);
+    for (int t = 1; t < started; t++)
+    {
+        pthread_join(workers[t].thread, NULL);
+    }
+    // Worker 0 is the calling thread, whose time the phase already includes
+    for (int t = 0; t < threads; t++)
+    {
+        ctx->stats.phases[PHASE_CODEGEN].cpu_ns += t > 0 ? workers[t].cpu_ns : 0;
+        ctx->stats.scope_lookups += workers[t].cg.scope_lookups;
+        ctx->stats.symbol_bytes += workers[t].cg.peak_symbol_bytes;
+        append_trace(&ctx->trace, &workers[t].trace);
+        free(workers[t].trace.events);
+    }
+    // Errors in the program are reported in source order, as a serial run
+    // would find them
+    CodeGen* cg = &ctx->codegen;
+    for (int t = 0; t < threads && job.error_batch == SIZE_MAX; t++)
+    {
+        const CodeGen* worker = &workers[t].cg;
+        for (size_t i = 0; i < worker->failure_count && cg->failure_count < DIAGNOSTICS_MAX; i++)
+        {
+            CodegenFailure* failures = cg->failures;
+            if (cg->failure_count == cg->failure_capacity)
+            {
+                size_t grown = cg->failure_capacity ? cg->failure_capacity * 2 : 16;
+                failures = (CodegenFailure*)realloc(cg->failures, grown * sizeof(CodegenFailure));
+                if (!failures)
+                {
+                    job.error_batch = 0;
+                    snprintf(job.error, sizeof(job.error), "Memory allocation failed for code generation");
+                    break;
+                }
+                cg->failures = failures;
+                cg->failure_capacity = grown;
+            }
+            failures[cg->failure_count++] = worker->failures[i];
+        }
+    }
+    if (cg->failure_count > 1)
+    {
+        qsort(cg->failures, cg->failure_count, sizeof(CodegenFailure), compare_codegen_failures);
+    }
+    for (int t = 0; t < threads; t++)
+    {
+        free_codegen(&workers[t].cg);
+    }
+    free(workers);
+    pthread_mutex_destroy(&job.error_lock);
+
+    Code* out = &ctx->code;
+    size_t total = out->count;
+    for (size_t b = 0; b < job.batch_count; b++)
+    {
+        total += job.batches[b].count;
+    }
+    int failed = job.error_batch != SIZE_MAX;
+    if (!failed && total > out->capacity)
+    {
+        Inst* insts = (Inst*)realloc(out->insts, total * sizeof(Inst));
+        if (insts)
+        {
+            out->insts = insts;
+            out->capacity = total;
+        }
+        else
+        {
+            failed = 1;
+            snprintf(job.error, sizeof(job.error), "Memory allocation failed for code generation");
+        }
+    }
+    for (size_t b = 0; b < job.batch_count; b++)
+    {
+        Code* batch = &job.batches[b];
+        if (!failed && batch->count)
+        {
+            memcpy(&out->insts[out->count], batch->insts, batch->count * sizeof(Inst));
+            out->count += batch->count;
+        }
+        free(batch->insts);
+    }
+    free(job.batches);
+    if (failed)
+    {
+        fail(&ctx->errors, "%s", job.error);
+    }
+}
+
+void* codegen_worker(void* arg)
+{
+    CodegenWorker* worker = (CodegenWorker*)arg;
+    CodegenJob* job = worker->job;
+    uint64_t start = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+    worker->trace.thread = current_thread_id();
+    for (;;)
+    {
+        size_t batch = __atomic_fetch_add(&job->next_batch, 1, __ATOMIC_RELAXED);
+        if (batch >= job->batch_count)
+        {
+            break;
+        }
+        // Batches after one that failed can not change the outcome
+        if (batch < __atomic_load_n(&job->error_batch, __ATOMIC_RELAXED))
+        {
+            run_codegen_batch(worker, batch);
+        }
+    }
+    worker->cpu_ns = clock_ns(CLOCK_THREAD_CPUTIME_ID) - start;
+    return NULL;
+}
+
+void run_codegen_batch(CodegenWorker* worker, size_t batch)
+{
+    CodegenJob* job = worker->job;
+    CodeGen* cg = &worker->cg;
+    const Ast* ast = job->ast;
+    cg->code = &job->batches[batch];
+    size_t end = (batch + 1) * CODEGEN_BATCH_SIZE;
+    if (gen_functions(cg, ast, batch * CODEGEN_BATCH_SIZE, end < ast->function_count ? end : ast->function_count) != 0)
+    {
+        pthread_mutex_lock(&job->error_lock);
+        if (batch < job->error_batch)
+        {
+            memcpy(job->error, worker->errors.message, sizeof(job->error));
+            __atomic_store_n(&job->error_batch, batch, __ATOMIC_RELAXED);
+        }
+        pthread_mutex_unlock(&job->error_lock);
+    }
+}
+
+// Load a number, variable or call result into rax
+void gen_value_stack(CodeGen* cg, const Node* value, const char* context)
+{
+    if (value->type == NODE_NUMBER)
+    {
+        gen_mov_imm(cg, REG_RAX, value->value);
+    }
+    else if (value->type == NODE_VAR_REF)
+    {
+        gen_load_local32(cg, REG_RAX, use_variable(cg, value)->stack_offset);
+    }
+    else if (value->type == NODE_CALL)
+    {
+        gen_call(cg, value->name);
+    }
+    else
+    {
+        fail(cg->errors, "Invalid %s expression type %d", context, value->type);
+    }
+}
+
+// -O0: every variable lives in an rbp-relative stack slot and every value
+// goes through rax
+void gen_function_stack(CodeGen* cg, const Ast* ast, const Function* func)
+{
+    const Node* body = &ast->nodes[func->first_stmt];
+    gen_label(cg, func->name);
+    gen_reg(cg, OP_PUSH, REG_RBP);
+    gen_mov(cg, REG_RBP, REG_RSP);
+
+    // Each function starts with a fresh scope
+    push_scope(cg);
+
+    int frame_size = layout_frame(cg, ast, func);
+    if (frame_size > 0)
+    {
+        gen_sub_imm(cg, REG_RSP, frame_size);
+    }
+
+    // Generate code for function body statements, in order
+    int returned = 0;
+    for (uint32_t i = 0; i < func->stmt_count; i++)
+    {
+        const Node* stmt = &body[i];
+        if (stmt->type == NODE_VAR_DECL)
+        {
+            Symbol* symbol = add_variable(cg, stmt);
+            symbol->stack_offset = 4 * cg->frame.vars[stmt->name].slot;
+
+            // Handle initialization if present
+            if (stmt->child != NODE_NONE)
+            {
+                gen_value_stack(cg, &ast->nodes[stmt->child], "initialization");
+                gen_store_local32(cg, symbol->stack_offset, REG_RAX);
+            }
+        }
+        else if (stmt->type == NODE_RETURN)
+        {
+            gen_value_stack(cg, &ast->nodes[stmt->child], "return");
+            gen_return_stack(cg, frame_size);
+            returned = 1;
+        }
+        else if (stmt->type == NODE_CALL)
+        {
+            gen_call(cg, stmt->name);
+        }
+        else if (stmt->type == NODE_VAR_ASSIGN)
+        {
+            gen_value_stack(cg, &ast->nodes[stmt->child], "assignment");
+            gen_store_local32(cg, use_variable(cg, stmt)->stack_offset, REG_RAX);
+        }
+    }
+
+    // Falling off the end returns 0, as it does at -O1
+    if (!returned)
+    {
+        gen_mov_imm(cg, REG_RAX, 0);
+        gen_return_stack(cg, frame_size);
+    }
+    pop_scope(cg);
+}
+
+// Epilogue of a -O0 function, with its result in rax
+void gen_return_stack(CodeGen* cg, int frame_size)
+{
+    if (frame_size > 0)
+    {
+        gen_mov(cg, REG_RSP, REG_RBP);
+    }
+    gen_reg(cg, OP_POP, REG_RBP);
+    gen_op(cg, OP_RET);
+}
+
+// Give each variable of func a 4-byte slot. Function bodies are straight-line
+// code, so a variable is live from its declaration to the last statement that
+// mentions it, after which its slot goes to the next variable declared.
+// Returns the size of the frame, a multiple of 16 when the function makes
+// calls so that they are made with rsp aligned as the SysV ABI requires.
+// Variables misused are left to the code generation that follows to report.
+int layout_frame(CodeGen* cg, const Ast* ast, const Function* func)
+{
+    Frame* frame = &cg->frame;
+    size_t name_count = cg->names->count;
+    if (name_count > frame->var_capacity)
+    {
+        FrameVar* vars = (FrameVar*)realloc(frame->vars, name_count * sizeof(FrameVar));
+        if (!vars)
+        {
+            fail(cg->errors, "Memory allocation failed for stack frame");
+        }
+        memset(vars + frame->var_capacity, 0, (name_count - frame->var_capacity) * sizeof(FrameVar));
+        frame->vars = vars;
+        frame->var_capacity = name_count;
+    }
+    if (++frame->epoch == 0)
+    {
+        memset(frame->vars, 0, frame->var_capacity * sizeof(FrameVar));
+        frame->epoch = 1;
+    }
+
+    const Node* body = &ast->nodes[func->first_stmt];
+    int has_calls = 0;
+    for (uint32_t i = 0; i < func->stmt_count; i++)
+    {
+        uint32_t names[2];
+        for (int n = stmt_variables(ast, &body[i], names); n-- > 0;)
+        {
+            FrameVar* var = &frame->vars[names[n]];
+            if (var->epoch != frame->epoch)
+            {
+                var->epoch = frame->epoch;
+                var->slot = 0;
+            }
+            var->last_use = i;
+        }
+        const Node* value = body[i].child != NODE_NONE ? &ast->nodes[body[i].child] : NULL;
+        has_calls |= body[i].type == NODE_CALL || (value && value->type == NODE_CALL);
+    }
+
+    int slot_count = 0;
+    frame->free_count = 0;
+    for (uint32_t i = 0; i < func->stmt_count; i++)
+    {
+        if (body[i].type == NODE_VAR_DECL)
+        {
+            frame->vars[body[i].name].slot = frame->free_count ? frame->free_slots[--frame->free_count] : ++slot_count;
+        }
+        uint32_t names[2];
+        for (int n = stmt_variables(ast, &body[i], names); n-- > 0;)
+        {
+            FrameVar* var = &frame->vars[names[n]];
+            if (var->last_use == i && var->slot)
+            {
+                if (frame->free_count == frame->free_capacity)
+                {
+                    frame->free_slots = (int*)grow_array(cg->errors, frame->free_slots, &frame->free_capacity, sizeof(int));
+                }
+                frame->free_slots[frame->free_count++] = var->slot;
+                var->last_use = UINT32_MAX; // Freed once even if mentioned twice
+            }
+        }
+    }
+
+    int size = 4 * slot_count;
+    return has_calls ? (size + 15) & ~15 : size;
+}
+
+// Variables stmt mentions, with names[0] the one it declares or assigns if
+// any. Returns how many there are.
+int stmt_variables(const Ast* ast, const Node* stmt, uint32_t names[2])
+{
+    int count = 0;
+    if (stmt->type == NODE_VAR_DECL || stmt->type == NODE_VAR_ASSIGN)
+    {
+        names[count++] = stmt->name;
+    }
+    if (stmt->child != NODE_NONE && ast->nodes[stmt->child].type == NODE_VAR_REF)
+    {
+        names[count++] = ast->nodes[stmt->child].name;
+    }
+    return count;
+}
+
+uint32_t new_vreg(CodeGen* cg)
+{
+    if (cg->ir.vreg_count == cg->ir.vreg_capacity)
+    {
+        cg->ir.intervals = (Interval*)grow_array(cg->errors, cg->ir.intervals, &cg->ir.vreg_capacity, sizeof(Interval));
+    }
+    Interval* interval = &cg->ir.intervals[cg->ir.vreg_count];
+    interval->vreg = (uint32_t)cg->ir.vreg_count;
+    interval->start = UINT32_MAX;
+    interval->end = 0;
+    interval->hint = REG_NONE;
+    return (uint32_t)cg->ir.vreg_count++;
+}
+
+void add_ir(CodeGen* cg, enum IrOp op, uint32_t dst, uint32_t src, int imm, uint32_t name)
+{
+    if (cg->ir.count == cg->ir.capacity)
+    {
+        cg->ir.insts = (IrInst*)grow_array(cg->errors, cg->ir.insts, &cg->ir.capacity, sizeof(IrInst));
+    }
+    cg->ir.insts[cg->ir.count++] = (IrInst){(uint8_t)op, dst, src, imm, name};
+}
+
+// Lower a number, variable or call into virtual register dst. With dst
+// VREG_NONE the value is left wherever is cheapest, a variable's own register
+// or a fresh one, and that register is returned.
+uint32_t lower_value(CodeGen* cg, const Node* value, uint32_t dst)
+{
+    if (value->type == NODE_VAR_REF)
+    {
+        const Symbol* symbol = use_variable(cg, value);
+        if (dst == VREG_NONE)
+        {
+            return symbol->vreg;
+        }
+        add_ir(cg, IR_COPY, dst, symbol->vreg, 0, NAME_NONE);
+        return dst;
+    }
+    if (dst == VREG_NONE)
+    {
+        dst = new_vreg(cg);
+    }
+    if (value->type == NODE_NUMBER)
+    {
+        add_ir(cg, IR_CONST, dst, VREG_NONE, value->value, NAME_NONE);
+    }
+    else
+    {
+        add_ir(cg, IR_CALL, dst, VREG_NONE, 0, value->name);
+    }
+    return dst;
+}
+
+// Lower one function body to straight-line IR in ir
+void lower_function(CodeGen* cg, const Ast* ast, const Function* func)
+{
+    const Node* body = &ast->nodes[func->first_stmt];
+    cg->ir.count = 0;
+    cg->ir.vreg_count = 0;
+    push_scope(cg);
+    for (uint32_t i = 0; i < func->stmt_count; i++)
+    {
+        const Node* stmt = &body[i];
+        if (stmt->type == NODE_VAR_DECL)
+        {
+            Symbol* symbol = add_variable(cg, stmt);
+            symbol->vreg = new_vreg(cg);
+            if (stmt->child != NODE_NONE)
+            {
+                lower_value(cg, &ast->nodes[stmt->child], symbol->vreg);
+            }
+        }
+        else if (stmt->type == NODE_VAR_ASSIGN)
+        {
+            const Symbol* symbol = use_variable(cg, stmt);
+            lower_value(cg, &ast->nodes[stmt->child], symbol->vreg);
+        }
+        else if (stmt->type == NODE_CALL)
+        {
+            add_ir(cg, IR_CALL, VREG_NONE, VREG_NONE, 0, stmt->name);
+        }
+        else if (stmt->type == NODE_RETURN)
+        {
+            add_ir(cg, IR_RET, VREG_NONE, lower_value(cg, &ast->nodes[stmt->child], VREG_NONE), 0, NAME_NONE);
+            break; // Nothing after a return is reachable
+        }
+    }
+    pop_scope(cg);
+}
+
+// Live interval of each virtual register over instruction positions: from its
+// first definition to its last use. The code is straight-line, so this is
+// exact apart from registers that are redefined.
+void compute_intervals(CodeGen* cg)
+{
+    for (size_t i = 0; i < cg->ir.vreg_count; i++)
+    {
+        cg->ir.intervals[i].start = UINT32_MAX;
+        cg->ir.intervals[i].end = 0;
+        cg->ir.intervals[i].used = 0;
+        cg->ir.intervals[i].hint = REG_NONE;
+    }
+    for (uint32_t p = 0; p < cg->ir.count; p++)
+    {
+        const IrInst* inst = &cg->ir.insts[p];
+        if (inst->src != VREG_NONE)
+        {
+            Interval* interval = &cg->ir.intervals[inst->src];
+            if (interval->start > p) interval->start = p; // Used before any definition
+            interval->end = p;
+            interval->used = 1;
+            if (inst->op == IR_RET) interval->hint = REG_RAX;
+        }
+        if (inst->dst != VREG_NONE)
+        {
+            Interval* interval = &cg->ir.intervals[inst->dst];
+            if (interval->start > p) interval->start = p;
+            if (interval->end < p) interval->end = p;
+            if (inst->op == IR_CALL && interval->hint == REG_NONE) interval->hint = REG_RAX;
+        }
+    }
+}
+
+int compare_interval_start(const void* a, const void* b)
+{
+    const Interval* x = *(const Interval* const*)a;
+    const Interval* y = *(const Interval* const*)b;
+    return x->start < y->start ? -1 : x->start > y->start;
+}
+
+// Linear-scan register allocation (Poletto and Sarkar). Intervals that span a
+// call may only use callee-saved registers; when none is free the interval
+// ending last is spilled to a stack slot for its whole lifetime.
+void allocate_registers(CodeGen* cg, RegAlloc* ra)
+{
+    memset(ra, 0, sizeof(RegAlloc));
+
+    // Prefix counts of calls let a span test look at any interval in O(1)
+    uint32_t* calls_before = (uint32_t*)malloc((cg->ir.count + 1) * sizeof(uint32_t));
+    Interval** order = (Interval**)malloc((cg->ir.vreg_count + 1) * sizeof(Interval*));
+    Interval** active = (Interval**)malloc((cg->ir.vreg_count + 1) * sizeof(Interval*));
+    if (!calls_before || !order || !active)
+    {
+        fail(cg->errors, "Memory allocation failed for register allocation");
+    }
+    calls_before[0] = 0;
+    for (size_t p = 0; p < cg->ir.count; p++)
+    {
+        calls_before[p + 1] = calls_before[p] + (cg->ir.insts[p].op == IR_CALL);
+    }
+    ra->has_calls = calls_before[cg->ir.count] > 0;
+
+    size_t order_count = 0;
+    for (size_t v = 0; v < cg->ir.vreg_count; v++)
+    {
+        Interval* interval = &cg->ir.intervals[v];
+        interval->location = LOC_DEAD;
+        if (interval->used)
+        {
+            interval->crosses_call = calls_before[interval->end] > calls_before[interval->start + 1];
+            order[order_count++] = interval;
+        }
+    }
+    qsort(order, order_count, sizeof(Interval*), compare_interval_start);
+
+    int reg_busy[REG_COUNT] = {0};
+    size_t active_count = 0;
+    for (size_t i = 0; i < order_count; i++)
+    {
+        Interval* current = order[i];
+
+        // Expire intervals that ended; active is kept sorted by end
+        size_t kept = 0;
+        for (size_t a = 0; a < active_count; a++)
+        {
+            if (active[a]->end <= current->start)
+            {
+                reg_busy[active[a]->location] = 0;
+            }
+            else
+            {
+                active[kept++] = active[a];
+            }
+        }
+        active_count = kept;
+
+        // Hinted register first, then caller-saved (unless the interval spans a
+        // call), then callee-saved
+        int reg = REG_NONE;
+        if (current->hint != REG_NONE && !reg_busy[current->hint] && !(current->crosses_call && !is_callee_saved(current->hint)))
+        {
+            reg = current->hint;
+        }
+        for (size_t r = 0; reg == REG_NONE && r < sizeof(allocation_order); r++)
+        {
+            int candidate = allocation_order[r];
+            if (!reg_busy[candidate] && !(current->crosses_call && !is_callee_saved(candidate)))
+            {
+                reg = candidate;
+            }
+        }
+
+        if (reg == REG_NONE)
+        {
+            // Steal the register of the compatible active interval ending last
+            // if that ends after the current one, otherwise spill the current one
+            Interval* victim = NULL;
+            for (size_t a = active_count; a-- > 0;)
+            {
+                if (!current->crosses_call || is_callee_saved(active[a]->location))
+                {
+                    victim = active[a];
+                    break;
+                }
+            }
+            if (victim && victim->end > current->end)
+            {
+                reg = victim->location;
+                victim->location = LOC_SPILLED;
+                victim->slot = ra->spill_slots++;
+                size_t a = 0;
+                while (active[a] != victim) a++;
+                memmove(&active[a], &active[a + 1], (active_count - a - 1) * sizeof(Interval*));
+                active_count--;
+            }
+            else
+            {
+                current->location = LOC_SPILLED;
+                current->slot = ra->spill_slots++;
+                continue;
+            }
+        }
+
+        current->location = reg;
+        reg_busy[reg] = 1;
+        if (is_callee_saved(reg) && !(ra->saved_mask & (1u << reg)))
+        {
+            ra->saved_mask |= 1u << reg;
+            ra->saved[ra->saved_count++] = (uint8_t)reg;
+        }
+        size_t a = active_count++;
+        while (a > 0 && active[a - 1]->end > current->end)
+        {
+            active[a] = active[a - 1];
+            a--;
+        }
+        active[a] = current;
+    }
+
+    free(active);
+    free(order);
+    free(calls_before);
+}
+
+int is_callee_saved(int reg)
+{
+    return reg == REG_RBX || reg >= REG_R12;
+}
+
+// Put the value of vreg into a register: its own, or the scratch register
+// when it lives on the stack
+enum Register gen_use(CodeGen* cg, uint32_t vreg)
+{
+    const Interval* interval = &cg->ir.intervals[vreg];
+    if (interval->location == LOC_SPILLED)
+    {
+        gen_load_local(cg, REG_SCRATCH, spill_offset(interval->slot));
+        return REG_SCRATCH;
+    }
+    return (enum Register)interval->location;
+}
+
+// Move a value held in reg into vreg's location
+void gen_def(CodeGen* cg, uint32_t vreg, enum Register reg)
+{
+    const Interval* interval = &cg->ir.intervals[vreg];
+    if (interval->location == LOC_SPILLED)
+    {
+        gen_store_local(cg, spill_offset(interval->slot), reg);
+    }
+    else if (interval->location != (int)reg)
+    {
+        gen_mov(cg, (enum Register)interval->location, reg);
+    }
+}
+
+int spill_offset(int slot)
+{
+    return 8 * (slot + 1);
+}
+
+void gen_epilogue(CodeGen* cg, const RegAlloc* ra)
+{
+    if (ra->padding)
+    {
+        gen_add_imm(cg, REG_RSP, ra->padding);
+    }
+    for (int i = ra->saved_count; i-- > 0;)
+    {
+        gen_reg(cg, OP_POP, (enum Register)ra->saved[i]);
+    }
+    if (ra->spill_slots > 0)
+    {
+        gen_mov(cg, REG_RSP, REG_RBP);
+        gen_reg(cg, OP_POP, REG_RBP);
+    }
+    gen_op(cg, OP_RET);
+}
+
+// -O1 and up: lower to IR, allocate registers with linear scan, and build
+// only as much frame as the allocation needs. Leaf functions that fit in
+// caller-saved registers get no frame at all.
+void gen_function_regalloc(CodeGen* cg, const Ast* ast, const Function* func)
+{
+    lower_function(cg, ast, func);
+    compute_intervals(cg);
+    RegAlloc ra;
+    allocate_registers(cg, &ra);
+
+    // Keep rsp 16-byte aligned at call sites as the SysV ABI requires; it is
+    // 8 off at entry because of the return address
+    gen_label(cg, func->name);
+    int pushed = ra.saved_count;
+    if (ra.spill_slots > 0)
+    {
+        gen_reg(cg, OP_PUSH, REG_RBP);
+        gen_mov(cg, REG_RBP, REG_RSP);
+        int frame = 8 * ra.spill_slots;
+        if (ra.has_calls && (frame + 8 * pushed) % 16) frame += 8;
+        gen_sub_imm(cg, REG_RSP, frame);
+    }
+    else if (ra.has_calls && pushed % 2 == 0)
+    {
+        ra.padding = 8;
+    }
+    for (int i = 0; i < ra.saved_count; i++)
+    {
+        gen_reg(cg, OP_PUSH, (enum Register)ra.saved[i]);
+    }
+    if (ra.padding)
+    {
+        gen_sub_imm(cg, REG_RSP, ra.padding);
+    }
+
+    int returned = 0;
+    for (size_t p = 0; p < cg->ir.count; p++)
+    {
+        const IrInst* inst = &cg->ir.insts[p];
+        int dead = inst->dst != VREG_NONE && cg->ir.intervals[inst->dst].location == LOC_DEAD;
+        if (inst->op == IR_CONST)
+        {
+            if (dead) continue;
+            const Interval* interval = &cg->ir.intervals[inst->dst];
+            enum Register reg = interval->location == LOC_SPILLED ? REG_SCRATCH : (enum Register)interval->location;
+            gen_mov_imm(cg, reg, inst->imm);
+            gen_def(cg, inst->dst, reg);
+        }
+        else if (inst->op == IR_COPY)
+        {
+            if (dead) continue;
+            gen_def(cg, inst->dst, gen_use(cg, inst->src));
+        }
+        else if (inst->op == IR_CALL)
+        {
+            gen_call(cg, inst->name);
+            if (inst->dst != VREG_NONE && !dead) gen_def(cg, inst->dst, REG_RAX);
+        }
+        else if (inst->op == IR_RET)
+        {
+            enum Register reg = gen_use(cg, inst->src);
+            if (reg != REG_RAX) gen_mov(cg, REG_RAX, reg);
+            gen_epilogue(cg, &ra);
+            returned = 1;
+        }
+    }
+
+    // Falling off the end returns 0. C only requires that of main, but every
+    // function does it so that none runs into the code after it, and -O0
+    // does the same.
+    if (!returned)
+    {
+        gen_mov_imm(cg, REG_RAX, 0);
+        gen_epilogue(cg, &ra);
+    }
+}
+
+void emit_reserve(Emitter* e, size_t length)
+{
+    if (e->file && e->length >= EMITTER_FLUSH_SIZE)
+    {
+        emit_flush(e);
+    }
+    if (e->length + length > e->capacity)
+    {
+        size_t capacity = e->capacity ? e->capacity : EMITTER_INITIAL_CAPACITY;
+        while (capacity < e->length + length) capacity *= 2;
+        e->data = (char*)realloc(e->data, capacity);
+        if (!e->data)
+        {
+            fail(e->errors, "Memory allocation failed for output buffer");
+        }
+        e->capacity = capacity;
+    }
+}
+
+void emit_text(Emitter* e, const char* text, size_t length)
+{
+    emit_reserve(e, length);
+    memcpy(e->data + e->length, text, length);
+    e->length += length;
+}
+
+void emit_int(Emitter* e, int value)
+{
+    char digits[12];
+    size_t n = sizeof(digits);
+    unsigned int magnitude = value < 0 ? 0u - (unsigned int)value : (unsigned int)value;
+    do
+    {
+        digits[--n] = (char)('0' + magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude);
+    if (value < 0) digits[--n] = '-';
+    emit_text(e, digits + n, sizeof(digits) - n);
+}
+
+void emit_name(Emitter* e, uint32_t name)
+{
+    emit_text(e, name_text(e->names, name), e->names->lengths[name]);
+}
+
+void emit_reg(Emitter* e, enum Register reg)
+{
+    emit_text(e, register_names[reg], strlen(register_names[reg]));
+}
+
+void emit_reg32(Emitter* e, enum Register reg)
+{
+    emit_text(e, register_names32[reg], strlen(register_names32[reg]));
+}
+
+// Write out everything buffered so far
+void emit_flush(Emitter* e)
+{
+    if (e->file && e->length)
+    {
+        if (fwrite(e->data, 1, e->length, e->file) != e->length)
+        {
+            fail(e->errors, "cannot write output file");
+        }
+        e->length = 0;
+    }
+}
+
+void emit_label(Emitter* e, uint32_t name)
+{
+    emit_name(e, name);
+    EMIT_LITERAL(e, ":\n");
+}
+
+void emit_call(Emitter* e, uint32_t name)
+{
+    EMIT_LITERAL(e, "    call ");
+    emit_name(e, name);
+    EMIT_LITERAL(e, "\n");
+}
+
+// mov reg, imm
+void emit_mov_imm(Emitter* e, enum Register reg, int value)
+{
+    EMIT_LITERAL(e, "    mov ");
+    emit_reg(e, reg);
+    EMIT_LITERAL(e, ", ");
+    emit_int(e, value);
+    EMIT_LITERAL(e, "\n");
+}
+
+// mov reg, [rbp - offset]
+void emit_load_local(Emitter* e, enum Register reg, int offset)
+{
+    EMIT_LITERAL(e, "    mov ");
+    emit_reg(e, reg);
+    EMIT_LITERAL(e, ", [rbp - ");
+    emit_int(e, offset);
+    EMIT_LITERAL(e, "]\n");
+}
+
+// mov [rbp - offset], reg
+void emit_store_local(Emitter* e, int offset, enum Register reg)
+{
+    EMIT_LITERAL(e, "    mov [rbp - ");
+    emit_int(e, offset);
+    EMIT_LITERAL(e, "], ");
+    emit_reg(e, reg);
+    EMIT_LITERAL(e, "\n");
+}
+
+// mov reg32, [rbp - offset]
+void emit_load_local32(Emitter* e, enum Register reg, int offset)
+{
+    EMIT_LITERAL(e, "    mov ");
+    emit_reg32(e, reg);
+    EMIT_LITERAL(e, ", [rbp - ");
+    emit_int(e, offset);
+    EMIT_LITERAL(e, "]\n");
+}
+
+// mov [rbp - offset], reg32
+void emit_store_local32(Emitter* e, int offset, enum Register reg)
+{
+    EMIT_LITERAL(e, "    mov [rbp - ");
+    emit_int(e, offset);
+    EMIT_LITERAL(e, "], ");
+    emit_reg32(e, reg);
+    EMIT_LITERAL(e, "\n");
+}
+
+// sub reg, imm
+void emit_sub_imm(Emitter* e, enum Register reg, int value)
+{
+    EMIT_LITERAL(e, "    sub ");
+    emit_reg(e, reg);
+    EMIT_LITERAL(e, ", ");
+    emit_int(e, value);
+    EMIT_LITERAL(e, "\n");
+}
+
+// add reg, imm
+void emit_add_imm(Emitter* e, enum Register reg, int value)
+{
+    EMIT_LITERAL(e, "    add ");
+    emit_reg(e, reg);
+    EMIT_LITERAL(e, ", ");
+    emit_int(e, value);
+    EMIT_LITERAL(e, "\n");
+}
+
+Inst* add_inst(CodeGen* cg, enum Opcode op)
+{
+    Code* code = cg->code;
+    if (code->count == code->capacity)
+    {
+        code->insts = (Inst*)grow_array(cg->errors, code->insts, &code->capacity, sizeof(Inst));
+    }
+    Inst* inst = &code->insts[code->count++];
+    memset(inst, 0, sizeof(Inst));
+    inst->op = (uint8_t)op;
+    return inst;
+}
+
+void gen_label(CodeGen* cg, uint32_t name)
+{
+    add_inst(cg, OP_LABEL)->name = name;
+}
+
+// push, pop
+void gen_reg(CodeGen* cg, enum Opcode op, enum Register reg)
+{
+    add_inst(cg, op)->dst = (uint8_t)reg;
+}
+
+void gen_mov(CodeGen* cg, enum Register dst, enum Register src)
+{
+    Inst* inst = add_inst(cg, OP_MOV);
+    inst->dst = (uint8_t)dst;
+    inst->src = (uint8_t)src;
+}
+
+void gen_mov_imm(CodeGen* cg, enum Register dst, int value)
+{
+    Inst* inst = add_inst(cg, OP_MOV_IMM);
+    inst->dst = (uint8_t)dst;
+    inst->imm = value;
+}
+
+void gen_load_local(CodeGen* cg, enum Register dst, int offset)
+{
+    Inst* inst = add_inst(cg, OP_LOAD);
+    inst->dst = (uint8_t)dst;
+    inst->imm = offset;
+}
+
+void gen_store_local(CodeGen* cg, int offset, enum Register src)
+{
+    Inst* inst = add_inst(cg, OP_STORE);
+    inst->src = (uint8_t)src;
+    inst->imm = offset;
+}
+
+void gen_load_local32(CodeGen* cg, enum Register dst, int offset)
+{
+    Inst* inst = add_inst(cg, OP_LOAD32);
+    inst->dst = (uint8_t)dst;
+    inst->imm = offset;
+}
+
+void gen_store_local32(CodeGen* cg, int offset, enum Register src)
+{
+    Inst* inst = add_inst(cg, OP_STORE32);
+    inst->src = (uint8_t)src;
+    inst->imm = offset;
+}
+
+void gen_sub_imm(CodeGen* cg, enum Register dst, int value)
+{
+    Inst* inst = add_inst(cg, OP_SUB_IMM);
+    inst->dst = (uint8_t)dst;
+    inst->imm = value;
+}
+
+void gen_add_imm(CodeGen* cg, enum Register dst, int value)
+{
+    Inst* inst = add_inst(cg, OP_ADD_IMM);
+    inst->dst = (uint8_t)dst;
+    inst->imm = value;
+}
 
-    system(asmCommand);
-    return 0;
+void gen_call(CodeGen* cg, uint32_t name)
+{
+    add_inst(cg, OP_CALL)->name = name;
 }
 
-void compile(const char* input_file, const char* output_file)
+// ret, syscall
+void gen_op(CodeGen* cg, enum Opcode op)
 {
-    read_input(input_file);
-    tokenize();
-    token_pos = 0;
-    Node* ast = parse_program();
+    add_inst(cg, op);
+}
 
-    output = fopen(output_file, "w");
-    if (!output)
+// Rewrite the instruction list in place into shorter equivalent code:
+// - a load of the slot just stored becomes a register move, or nothing
+// - mov reg, 0 becomes xor reg32, reg32 and other non-negative immediates use
+//   the zero-extending 32-bit mov
+// - mov rsp, rbp; pop rbp becomes leave
+// - when main only returns a constant, the start stub passes it to sys_exit
+//   directly instead of calling main
+void peephole(Code* code, uint32_t main_name)
+{
+    int main_constant = 0;
+    int main_is_constant = 0;
+    for (size_t i = 0; i + 2 < code->count; i++)
     {
-        fprintf(stderr, "Error: cannot open output file %s\n", output_file);
-        exit(1);
+        const Inst* inst = &code->insts[i];
+        if (inst->op == OP_LABEL && inst->name == main_name)
+        {
+            main_is_constant = inst[1].op == OP_MOV_IMM && inst[1].dst == REG_RAX && inst[2].op == OP_RET;
+            main_constant = inst[1].imm;
+            break;
+        }
     }
 
-    // Initialize current_scope before generating code
-    current_scope = NULL;
-    generate_code(ast);
-    fclose(output);
-
-    // Clean up
-    free_ast(ast);
-    for(size_t i = 0; i < token_count; i++)
+    size_t out = 0;
+    for (size_t i = 0; i < code->count; i++)
     {
-        if (tokens[i].value) free(tokens[i].value);
+        Inst inst = code->insts[i];
+        Inst* prev = out > 0 ? &code->insts[out - 1] : NULL;
+        if (inst.op == OP_CALL && inst.name == main_name && main_is_constant && i + 1 < code->count &&
+            code->insts[i + 1].op == OP_MOV && code->insts[i + 1].dst == REG_RDI && code->insts[i + 1].src == REG_RAX)
+        {
+            inst = (Inst){.op = OP_MOV_IMM, .dst = REG_RDI, .imm = main_constant};
+            i++;
+        }
+        if (inst.op == OP_LOAD && prev && prev->op == OP_STORE && prev->imm == inst.imm)
+        {
+            if (inst.dst == prev->src)
+            {
+                continue;
+            }
+            inst = (Inst){.op = OP_MOV, .dst = inst.dst, .src = prev->src};
+        }
+        if (inst.op == OP_MOV && inst.dst == inst.src)
+        {
+            continue;
+        }
+        if (inst.op == OP_MOV_IMM && inst.imm >= 0)
+        {
+            inst.op = inst.imm == 0 ? OP_XOR32 : OP_MOV_IMM32;
+        }
+        if (inst.op == OP_POP && inst.dst == REG_RBP && prev && prev->op == OP_MOV && prev->dst == REG_RSP && prev->src == REG_RBP)
+        {
+            *prev = (Inst){.op = OP_LEAVE};
+            continue;
+        }
+        code->insts[out++] = inst;
     }
-    free(tokens);
-    free(input);
+    code->count = out;
 }
 
-void read_input(const char* filename)
+// Print the instruction list as a fasm source file
+void print_code(Emitter* e, const Code* code)
 {
-    FILE* file = fopen(filename, "r");
-    if (!file)
+    EMIT_LITERAL(e, "format ELF64 executable 3\n");
+    EMIT_LITERAL(e, "entry start\n");
+    EMIT_LITERAL(e, "segment readable executable\n");
+    for (size_t i = 0; i < code->count; i++)
     {
-        fprintf(stderr, "Error: cannot open input file %s\n", filename);
-        exit(1);
+        const Inst* inst = &code->insts[i];
+        switch (inst->op)
+        {
+            case OP_LABEL:
+                emit_label(e, inst->name);
+                break;
+            case OP_PUSH:
+                EMIT_LITERAL(e, "    push ");
+                emit_reg(e, inst->dst);
+                EMIT_LITERAL(e, "\n");
+                break;
+            case OP_POP:
+                EMIT_LITERAL(e, "    pop ");
+                emit_reg(e, inst->dst);
+                EMIT_LITERAL(e, "\n");
+                break;
+            case OP_MOV:
+                EMIT_LITERAL(e, "    mov ");
+                emit_reg(e, inst->dst);
+                EMIT_LITERAL(e, ", ");
+                emit_reg(e, inst->src);
+                EMIT_LITERAL(e, "\n");
+                break;
+            case OP_MOV_IMM:
+                emit_mov_imm(e, inst->dst, inst->imm);
+                break;
+            case OP_LOAD:
+                emit_load_local(e, inst->dst, inst->imm);
+                break;
+            case OP_STORE:
+                emit_store_local(e, inst->imm, inst->src);
+                break;
+            case OP_LOAD32:
+                emit_load_local32(e, inst->dst, inst->imm);
+                break;
+            case OP_STORE32:
+                emit_store_local32(e, inst->imm, inst->src);
+                break;
+            case OP_SUB_IMM:
+                emit_sub_imm(e, inst->dst, inst->imm);
+                break;
+            case OP_ADD_IMM:
+                emit_add_imm(e, inst->dst, inst->imm);
+                break;
+            case OP_CALL:
+                emit_call(e, inst->name);
+                break;
+            case OP_RET:
+                EMIT_LITERAL(e, "    ret\n\n");
+                break;
+            case OP_SYSCALL:
+                EMIT_LITERAL(e, "    syscall\n");
+                break;
+            case OP_MOV_IMM32:
+                EMIT_LITERAL(e, "    mov ");
+                emit_reg32(e, inst->dst);
+                EMIT_LITERAL(e, ", ");
+                emit_int(e, inst->imm);
+                EMIT_LITERAL(e, "\n");
+                break;
+            case OP_XOR32:
+                EMIT_LITERAL(e, "    xor ");
+                emit_reg32(e, inst->dst);
+                EMIT_LITERAL(e, ", ");
+                emit_reg32(e, inst->dst);
+                EMIT_LITERAL(e, "\n");
+                break;
+            case OP_LEAVE:
+                EMIT_LITERAL(e, "    leave\n");
+                break;
+        }
     }
+    EMIT_LITERAL(e, "segment readable writable\n");
+}
 
-    // Get amount of characters in the file
-    fseek(file, 0, SEEK_END);
-    input_size = ftell(file);
-    fseek(file, 0, SEEK_SET);
-
-    // Read the characters from the file
-    input = (char*)malloc(input_size + 1);
-    fread(input, 1, input_size, file);
-    input[input_size] = '\0';
-    fclose(file);
+void emit_byte(Emitter* e, uint8_t value)
+{
+    emit_reserve(e, 1);
+    e->data[e->length++] = (char)value;
 }
 
-void tokenize()
+void emit_u32(Emitter* e, uint32_t value)
 {
-    tokens = malloc(input_size * sizeof(Token)); // Correct allocation size
-    token_count = 0;
-    pos = 0;
-    while (1)
+    for (int i = 0; i < 4; i++)
     {
-        Token token = next_token();
-        tokens[token_count++] = token;
-        if (token.type == TOK_EOF) break;
+        emit_byte(e, (uint8_t)(value >> (8 * i)));
     }
 }
 
-// Lexer: Get next token
-Token next_token()
+// REX prefix for a 64-bit operation with operands reg (ModRM.reg) and rm
+void encode_rex_w(Emitter* e, int reg, int rm)
+{
+    emit_byte(e, (uint8_t)(0x48 | ((reg & 8) >> 1) | ((rm & 8) >> 3)));
+}
+
+// opcode reg, r/m with a register r/m operand
+void encode_rr(Emitter* e, uint8_t opcode, int reg, int rm)
 {
-    Token token = {TOK_UNKNOWN, NULL};
-    while (pos < input_size && isspace(input[pos])) pos++;
+    encode_rex_w(e, reg, rm);
+    emit_byte(e, opcode);
+    emit_byte(e, (uint8_t)(0xC0 | ((reg & 7) << 3) | (rm & 7)));
+}
 
-    if (pos >= input_size)
+// opcode reg, [rbp - offset], with 64-bit operands when wide and 32-bit ones
+// otherwise
+void encode_rbp_local(Emitter* e, uint8_t opcode, int reg, int offset, int wide)
+{
+    if (wide)
     {
-        token.type = TOK_EOF;
-        return token;
+        encode_rex_w(e, reg, REG_RBP);
     }
-
-    if (strncmp(&input[pos], "int", 3) == 0 && !isalnum(input[pos + 3]))
+    else if (reg & 8)
     {
-        token.type = TOK_INT;
-        pos += 3;
+        emit_byte(e, 0x44); // REX.R
     }
-    else if (strncmp(&input[pos], "return", 6) == 0 && !isalnum(input[pos + 6]))
+    emit_byte(e, opcode);
+    if (offset <= 128)
     {
-        token.type = TOK_RETURN;
-        pos += 6;
+        emit_byte(e, (uint8_t)(0x45 | ((reg & 7) << 3)));
+        emit_byte(e, (uint8_t)-offset);
     }
-    else if (isalpha(input[pos]))
+    else
     {
-        char* start = &input[pos];
-        while (isalnum(input[pos]))
-        {
-            pos++;
-        }
-        size_t len = &input[pos] - start;
-        token.type = TOK_IDENTIFIER;
-        token.value = malloc(len + 1);
-        strncpy(token.value, start, len);
-        token.value[len] = '\0';
+        emit_byte(e, (uint8_t)(0x85 | ((reg & 7) << 3)));
+        emit_u32(e, (uint32_t)-offset);
     }
-    else if (isdigit(input[pos]))
+}
+
+// Encode the instruction list as x86-64 machine code appended to e. Label
+// offsets are recorded, relative to the start of e, in label_offsets (indexed
+// by name, SIZE_MAX when undefined); call sites are left to be patched.
+void encode_code(Emitter* e, const Code* code, size_t* label_offsets, Fixup** fixups, size_t* fixup_capacity, size_t* fixup_count)
+{
+    for (size_t i = 0; i < code->count; i++)
     {
-        char* start = &input[pos];
-        while (isdigit(input[pos]))
+        const Inst* inst = &code->insts[i];
+        switch (inst->op)
         {
-            pos++;
+            case OP_LABEL:
+                // Functions defined twice were reported before code generation
+                if (label_offsets[inst->name] != SIZE_MAX)
+                {
+                    fail(e->errors, "Label %s is defined twice", name_text(e->names, inst->name));
+                }
+                label_offsets[inst->name] = e->length;
+                break;
+            case OP_PUSH:
+            case OP_POP:
+                if (inst->dst & 8) emit_byte(e, 0x41);
+                emit_byte(e, (uint8_t)((inst->op == OP_PUSH ? 0x50 : 0x58) + (inst->dst & 7)));
+                break;
+            case OP_MOV:
+                encode_rr(e, 0x89, inst->src, inst->dst); // mov r/m64, r64
+                break;
+            case OP_MOV_IMM:
+                encode_rr(e, 0xC7, 0, inst->dst); // mov r/m64, imm32 (sign-extended)
+                emit_u32(e, (uint32_t)inst->imm);
+                break;
+            case OP_LOAD:
+            case OP_LOAD32:
+                encode_rbp_local(e, 0x8B, inst->dst, inst->imm, inst->op == OP_LOAD);
+                break;
+            case OP_STORE:
+            case OP_STORE32:
+                encode_rbp_local(e, 0x89, inst->src, inst->imm, inst->op == OP_STORE);
+                break;
+            case OP_SUB_IMM:
+            case OP_ADD_IMM:
+            {
+                int extension = inst->op == OP_SUB_IMM ? 5 : 0; // ModRM.reg selects sub or add
+                if (inst->imm >= -128 && inst->imm <= 127)
+                {
+                    encode_rr(e, 0x83, extension, inst->dst); // op r/m64, imm8
+                    emit_byte(e, (uint8_t)inst->imm);
+                }
+                else
+                {
+                    encode_rr(e, 0x81, extension, inst->dst); // op r/m64, imm32
+                    emit_u32(e, (uint32_t)inst->imm);
+                }
+                break;
+            }
+            case OP_CALL:
+                emit_byte(e, 0xE8);
+                if (*fixup_count == *fixup_capacity)
+                {
+                    *fixups = (Fixup*)grow_array(e->errors, *fixups, fixup_capacity, sizeof(Fixup));
+                }
+                (*fixups)[(*fixup_count)++] = (Fixup){e->length, inst->name};
+                emit_u32(e, 0);
+                break;
+            case OP_RET:
+                emit_byte(e, 0xC3);
+                break;
+            case OP_SYSCALL:
+                emit_byte(e, 0x0F);
+                emit_byte(e, 0x05);
+                break;
+            case OP_MOV_IMM32:
+                if (inst->dst & 8) emit_byte(e, 0x41);
+                emit_byte(e, (uint8_t)(0xB8 + (inst->dst & 7))); // mov r32, imm32
+                emit_u32(e, (uint32_t)inst->imm);
+                break;
+            case OP_XOR32:
+                if (inst->dst & 8) emit_byte(e, 0x45);
+                emit_byte(e, 0x31); // xor r/m32, r32
+                emit_byte(e, (uint8_t)(0xC0 | ((inst->dst & 7) << 3) | (inst->dst & 7)));
+                break;
+            case OP_LEAVE:
+                emit_byte(e, 0xC9);
+                break;
         }
-        size_t len = &input[pos] - start;
-        token.type = TOK_NUMBER;
-        token.value = malloc(len + 1);
-        strncpy(token.value, start, len);
-        token.value[len] = '\0';
-    }
-    else if (input[pos] == ';')
-    {
-        token.type = TOK_SEMICOLON;
-        pos++;
-    }
-    else if (input[pos] == '{')
-    {
-        token.type = TOK_LBRACE;
-        pos++;
-    }
-    else if (input[pos] == '}')
-    {
-        token.type = TOK_RBRACE;
-        pos++;
-    }
-    else if (input[pos] == '(')
-    {
-        token.type = TOK_LPAREN;
-        pos++;
-    }
-    else if (input[pos] == ')')
-    {
-        token.type = TOK_RPAREN;
-        pos++;
-    }
-    else if (input[pos] == '=')
-    {
-        token.type = TOK_EQUAL;
-        pos++;
-    }
-    else
-    {
-        token.type = TOK_UNKNOWN;
     }
+}
 
-    return token;
+void put_u16(char* p, uint16_t value)
+{
+    p[0] = (char)value;
+    p[1] = (char)(value >> 8);
 }
 
-void init_scope()
+void put_u32(char* p, uint32_t value)
 {
-    current_scope = (Scope*)malloc(sizeof(Scope));
-    current_scope->symbols = NULL;
-    current_scope->symbol_count = 0;
-    current_scope->stack_size = 0;
+    put_u16(p, (uint16_t)value);
+    put_u16(p + 2, (uint16_t)(value >> 16));
 }
 
-void free_scope()
+void put_u64(char* p, uint64_t value)
 {
-    for (size_t i = 0; i < current_scope->symbol_count; i++)
-    {
-        free(current_scope->symbols[i].name);
-    }
-    free(current_scope->symbols);
-    free(current_scope);
+    put_u32(p, (uint32_t)value);
+    put_u32(p + 4, (uint32_t)(value >> 32));
+}
+
+void put_program_header(char* p, uint32_t flags, uint64_t offset, uint64_t address, uint64_t size)
+{
+    put_u32(p, 1);          // PT_LOAD
+    put_u32(p + 4, flags);
+    put_u64(p + 8, offset);
+    put_u64(p + 16, address);
+    put_u64(p + 24, address);
+    put_u64(p + 32, size);  // p_filesz
+    put_u64(p + 40, size);  // p_memsz
+    put_u64(p + 48, ELF_SEGMENT_ALIGN);
 }
 
-void add_variable(const char* name)
+// Encode the program into ctx->image as an ELF64 executable laid out like
+// fasm's "format ELF64 executable 3": the headers followed by one readable and
+// executable segment holding all code, then an empty readable and writable one
+void build_elf(CompilerContext* ctx)
 {
-    // Check for duplicate variable
-    for (size_t i = 0; i < current_scope->symbol_count; i++)
+    Emitter* image = &ctx->image;
+    image->length = 0;
+    emit_reserve(image, ELF_CODE_OFFSET);
+    memset(image->data, 0, ELF_CODE_OFFSET);
+    image->length = ELF_CODE_OFFSET;
+
+    size_t name_count = ctx->names.count;
+    if (name_count > ctx->label_capacity)
     {
-        if (strcmp(current_scope->symbols[i].name, name) == 0)
+        size_t* label_offsets = (size_t*)realloc(ctx->label_offsets, name_count * sizeof(size_t));
+        if (!label_offsets)
         {
-            fprintf(stderr, "Error: Variable %s already exists\n", name);
-            exit(1);
+            fail(&ctx->errors, "Memory allocation failed for label table");
         }
+        ctx->label_offsets = label_offsets;
+        ctx->label_capacity = name_count;
     }
+    size_t* label_offsets = ctx->label_offsets;
+    memset(label_offsets, 0xFF, name_count * sizeof(size_t));
+    size_t fixup_count = 0;
+    encode_code(image, &ctx->code, label_offsets, &ctx->fixups, &ctx->fixup_capacity, &fixup_count);
+    const Fixup* fixups = ctx->fixups;
 
-    current_scope->symbol_count++;
-    current_scope->symbols = (Symbol*)realloc(current_scope->symbols, current_scope->symbol_count * sizeof(Symbol));
-    current_scope->symbols[current_scope->symbol_count - 1].name = strdup(name);
-    current_scope->stack_size += 8; // 8 bytes for int
-    current_scope->symbols[current_scope->symbol_count - 1].stack_offset = current_scope->stack_size;
-}
-
-int get_variable_offset(const char* name)
-{
-    for (size_t i = 0; i < current_scope->symbol_count; i++)
+    for (size_t i = 0; i < fixup_count; i++)
     {
-        if (strcmp(current_scope->symbols[i].name, name) == 0)
+        size_t target = label_offsets[fixups[i].name];
+        if (target == SIZE_MAX)
         {
-            return current_scope->symbols[i].stack_offset;
+            fail(&ctx->errors, "Undefined function %s", name_text(&ctx->names, fixups[i].name));
         }
+        put_u32(image->data + fixups[i].offset, (uint32_t)(target - (fixups[i].offset + 4)));
     }
-    fprintf(stderr, "Error: Undefined variable %s\n", name);
-    exit(1);
+
+    size_t end = image->length;
+    char* h = image->data;
+    memcpy(h, "\x7f" "ELF", 4);
+    h[4] = 2;               // ELFCLASS64
+    h[5] = 1;               // ELFDATA2LSB
+    h[6] = 1;               // EV_CURRENT
+    h[7] = 3;               // ELFOSABI_LINUX
+    put_u16(h + 16, 2);     // ET_EXEC
+    put_u16(h + 18, 62);    // EM_X86_64
+    put_u32(h + 20, 1);     // EV_CURRENT
+    put_u64(h + 24, ELF_BASE_ADDRESS + label_offsets[intern(&ctx->names, "start", 5)]);
+    put_u64(h + 32, ELF_HEADER_SIZE); // e_phoff
+    put_u16(h + 52, ELF_HEADER_SIZE);
+    put_u16(h + 54, ELF_PROGRAM_HEADER_SIZE);
+    put_u16(h + 56, 2);     // e_phnum
+    put_u16(h + 58, 64);    // e_shentsize
+    put_program_header(h + ELF_HEADER_SIZE, 5, ELF_CODE_OFFSET, ELF_BASE_ADDRESS + ELF_CODE_OFFSET, end - ELF_CODE_OFFSET);
+    // The writable segment starts a page further on so the two never share one
+    put_program_header(h + ELF_HEADER_SIZE + ELF_PROGRAM_HEADER_SIZE, 6, end, ELF_BASE_ADDRESS + ELF_SEGMENT_ALIGN + end, 0);
+    ctx->stats.executable_bytes = image->length;
 }
 
-void generate_code(Node* node)
+void write_elf(CompilerContext* ctx, const char* path)
 {
-    fprintf(output, "format ELF64 executable 3\n");
-    fprintf(output, "entry start\n");
-    fprintf(output, "segment readable executable\n");
+    build_elf(ctx);
+    Emitter* image = &ctx->image;
 
-    // Initialize scope once
-    init_scope();
-
-    // Generate code for all functions
-    Node* current = node->next; // Skip PROGRAM node
-    while (current)
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0755);
+    if (fd < 0)
+    {
+        fail(&ctx->errors, "cannot open output file %s", path);
+    }
+    for (size_t written = 0; written < image->length;)
     {
-        if (current->type == NODE_FUNCTION)
+        ssize_t n = write(fd, image->data + written, image->length - written);
+        if (n < 0)
         {
-            if (!current->func_name)
-            {
-                fprintf(stderr, "Error: Function name is null\n");
-                exit(1);
-            }
-            fprintf(output, "%s:\n", current->func_name);
-            fprintf(output, "    push rbp\n");
-            fprintf(output, "    mov rbp, rsp\n");
-
-            // Reset stack_size for each function
-            current_scope->stack_size = 0;
-            // Clear previous symbols for the new function scope
-            for (size_t i = 0; i < current_scope->symbol_count; i++)
-            {
-                free(current_scope->symbols[i].name);
-            }
-            free(current_scope->symbols);
-            current_scope->symbols = NULL;
-            current_scope->symbol_count = 0;
-
-            // Allocate stack space for variables
-            Node* stmt = current->body;
-            while (stmt)
-            {
-                if (stmt->type == NODE_VAR_DECL)
-                {
-                    add_variable(stmt->var_name);
-
-                    // Handle initialization if present
-                    if (stmt->right)
-                    {
-                        int offset = get_variable_offset(stmt->var_name);
-                        if (stmt->right->type == NODE_NUMBER)
-                        {
-                            fprintf(output, "    mov rax, %d\n", stmt->right->value);
-                            fprintf(output, "    mov [rbp - %d], rax\n", offset);
-                        }
-                        else if (stmt->right->type == NODE_VAR_REF)
-                        {
-                            int right_offset = get_variable_offset(stmt->right->var_name);
-                            fprintf(output, "    mov rax, [rbp - %d]\n", right_offset);
-                            fprintf(output, "    mov [rbp - %d], rax\n", offset);
-                        }
-                        else if (stmt->right->type == NODE_CALL)
-                        {
-                            if (!stmt->right->func_name)
-                            {
-                                fprintf(stderr, "Error: Function call name is null in initialization\n");
-                                exit(1);
-                            }
-                            fprintf(output, "    call %s\n", stmt->right->func_name);
-                            fprintf(output, "    mov [rbp - %d], rax\n", offset);
-                        }
-                        else
-                        {
-                            fprintf(stderr, "Error: Invalid initialization expression type %d\n", stmt->right->type);
-                            exit(1);
-                        }
-                    }
-                }
-                stmt = stmt->next;
-            }
-            if (current_scope->stack_size > 0)
-            {
-                fprintf(output, "    sub rsp, %d\n", current_scope->stack_size);
-            }
-
-            // Generate code for function body statements
-            stmt = current->body;
-            while (stmt)
-            {
-                if (stmt->type == NODE_RETURN)
-                {
-                    if (!stmt->left) {
-                        fprintf(stderr, "Error: Return statement has no expression\n");
-                        exit(1);
-                    }
-                    if (stmt->left->type == NODE_NUMBER)
-                    {
-                        fprintf(output, "    mov rax, %d\n", stmt->left->value);
-                    }
-                    else if (stmt->left->type == NODE_CALL)
-                    {
-                        if (!stmt->left->func_name)
-                        {
-                            fprintf(stderr, "Error: Function call name is null in return\n");
-                            exit(1);
-                        }
-                        fprintf(output, "    call %s\n", stmt->left->func_name);
-                    }
-                    else if (stmt->left->type == NODE_VAR_REF)
-                    {
-                        int offset = get_variable_offset(stmt->left->var_name);
-                        fprintf(output, "    mov rax, [rbp - %d]\n", offset);
-                    }
-                    else
-                    {
-                        fprintf(stderr, "Error: Invalid return expression type %d\n", stmt->left->type);
-                        exit(1);
-                    }
-                    if (current_scope->stack_size > 0)
-                    {
-                        fprintf(output, "    mov rsp, rbp\n");
-                    }
-                    fprintf(output, "    pop rbp\n");
-                    fprintf(output, "    ret\n\n");
-                }
-                else if (stmt->type == NODE_CALL)
-                {
-                    if (!stmt->func_name)
-                    {
-                        fprintf(stderr, "Error: Function call name is null\n");
-                        exit(1);
-                    }
-                    fprintf(output, "    call %s\n", stmt->func_name);
-                }
-                else if (stmt->type == NODE_VAR_ASSIGN)
-                {
-                    int offset = get_variable_offset(stmt->var_name);
-                    if (stmt->right->type == NODE_NUMBER)
-                    {
-                        fprintf(output, "    mov rax, %d\n", stmt->right->value);
-                        fprintf(output, "    mov [rbp - %d], rax\n", offset);
-                    }
-                    else if (stmt->right->type == NODE_VAR_REF)
-                    {
-                        int right_offset = get_variable_offset(stmt->right->var_name);
-                        fprintf(output, "    mov rax, [rbp - %d]\n", right_offset);
-                        fprintf(output, "    mov [rbp - %d], rax\n", offset);
-                    }
-                    else if (stmt->right->type == NODE_CALL)
-                    {
-                        if (!stmt->right->func_name)
-                        {
-                            fprintf(stderr, "Error: Function call name is null in assignment\n");
-                            exit(1);
-                        }
-                        fprintf(output, "    call %s\n", stmt->right->func_name);
-                        fprintf(output, "    mov [rbp - %d], rax\n", offset);
-                    }
-                    else
-                    {
-                        fprintf(stderr, "Error: Invalid assignment expression type %d\n", stmt->right->type);
-                        exit(1);
-                    }
-                }
-                stmt = stmt->next;
-            }
+            close(fd);
+            fail(&ctx->errors, "cannot write output file %s", path);
         }
-        current = current->next;
+        written += (size_t)n;
     }
-
-    fprintf(output, "start:\n");
-    fprintf(output, "    call main\n");
-    fprintf(output, "    mov rdi, rax\n");
-    fprintf(output, "    mov rax, 60\n"); // sys_exit
-    fprintf(output, "    syscall\n");
-
-    fprintf(output, "segment readable writable\n");
-
-    // Free scope once at the end
-    free_scope();
+    close(fd);
 }
 
-void expect(enum TokenType type)
+void write_asm(CompilerContext* ctx, const char* path)
 {
-    if (token_pos >= token_count || tokens[token_pos].type != type)
+    Emitter* output = &ctx->output;
+    output->length = 0;
+    output->file = fopen(path, "w");
+    if (!output->file)
     {
-        fprintf(stderr, "Error: Expected token type %d, got %d at position %zu\n", type, tokens[token_pos].type, token_pos);
-        exit(1);
+        fail(&ctx->errors, "cannot open output file %s", path);
     }
-    token_pos++;
+    print_code(output, &ctx->code);
+    emit_flush(output);
+    fclose(output->file);
+    output->file = NULL;
 }
 
-Node* parse_program()
+// Double the capacity of a growable array once it is full
+void* grow_array(ErrorState* errors, void* items, size_t* capacity, size_t item_size)
 {
-    Node* program = (Node*)malloc(sizeof(Node));
-    program->type = NODE_PROGRAM;
-    program->next = NULL;
-    Node* current = program;
-
-    while (token_pos < token_count && tokens[token_pos].type != TOK_EOF)
+    size_t grown = *capacity ? *capacity * 2 : 64;
+    items = realloc(items, grown * item_size);
+    if (!items)
     {
-        Node* func = parse_function();
-        current->next = func;
-        current = func;
+        fail(errors, "Memory allocation failed for growable array");
     }
-    return program;
+    *capacity = grown;
+    return items;
 }
 
-Node* parse_function()
+uint32_t add_node(Ast* ast, Node node)
 {
-    expect(TOK_INT);
-    Node* node = (Node*)malloc(sizeof(Node));
-    node->type = NODE_FUNCTION;
-    node->next = NULL;
+    if (ast->node_count == ast->node_capacity)
+    {
+        if (ast->node_count >= NODE_NONE)
+        {
+            fail(ast->errors, "Too many AST nodes");
+        }
+        ast->nodes = (Node*)grow_array(ast->errors, ast->nodes, &ast->node_capacity, sizeof(Node));
+    }
+    ast->nodes[ast->node_count] = node;
+    return (uint32_t)ast->node_count++;
+}
 
-    if (tokens[token_pos].type != TOK_IDENTIFIER)
+void push_pending(Ast* ast, Node node)
+{
+    if (ast->pending_count == ast->pending_capacity)
     {
-        fprintf(stderr, "Error: Expected function name at position %zu\n", token_pos);
-        exit(1);
+        ast->pending = (Node*)grow_array(ast->errors, ast->pending, &ast->pending_capacity, sizeof(Node));
     }
-    node->func_name = strdup(tokens[token_pos].value);
-    expect(TOK_IDENTIFIER);
+    ast->pending[ast->pending_count++] = node;
+}
 
-    expect(TOK_LPAREN);
-    expect(TOK_RPAREN); // For now, supporting functions without parameters
-    expect(TOK_LBRACE);
-    node->body = parse_stmt_list();
-    expect(TOK_RBRACE);
+// Offsets past what a node holds have no location
+uint32_t node_offset(size_t offset)
+{
+    return offset < NODE_NO_OFFSET ? (uint32_t)offset : NODE_NO_OFFSET;
+}
 
-    return node;
+size_t node_location(const Node* node)
+{
+    return node->offset == NODE_NO_OFFSET ? SIZE_MAX : node->offset;
+}
+
+// Keep the arrays and the first name block for the next compilation. Nodes are
+// never freed one by one, so tearing down any program takes the same time.
+void reset_ast(Ast* ast)
+{
+    ast->node_count = 0;
+    ast->function_count = 0;
+    ast->pending_count = 0;
 }
 
-Node* parse_stmt_list()
+void expect(CompilerContext* ctx, enum TokenType type)
 {
-    Node* list = (Node*)malloc(sizeof(Node));
-    if (!list)
+    if (peek_token(ctx, 0)->type != type)
     {
-        fprintf(stderr, "Error: Memory allocation failed for statement list\n");
-        exit(1);
+        syntax_error(ctx, token_names[type]);
     }
-    list->type = NODE_STMT_LIST;
-    list->next = NULL;
-    list->left = NULL;
-    list->body = NULL;
-    list->func_name = NULL;
-    list->var_name = NULL;
+    advance_token(ctx);
+}
 
-    Node* current = list;
-    Node* prev = NULL;
+// Report that the current token is not the expected one, and go on parsing
+// from the innermost construct that recovers
+void syntax_error(CompilerContext* ctx, const char* expected)
+{
+    const Token* token = peek_token(ctx, 0);
+    char message[sizeof(ctx->errors.message)];
+    if (token->type == TOK_EOF)
+    {
+        snprintf(message, sizeof(message), "Expected %s at end of input", expected);
+    }
+    else
+    {
+        // Lexemes are only quoted up to a readable length
+        int length = token->length > 32 ? 32 : (int)token->length;
+        snprintf(message, sizeof(message), "Expected %s before '%.*s'", expected, length, ctx->input + token->start);
+    }
+    report_error(ctx, token->start, message);
+    if (ctx->diagnostics.count >= DIAGNOSTICS_MAX)
+    {
+        fail(&ctx->errors, "Too many errors, giving up");
+    }
+    longjmp(*ctx->recover, 1);
+}
 
-    while (token_pos < token_count && tokens[token_pos].type != TOK_RBRACE)
+// Panic mode within a statement list: drop the tokens of the statement in
+// error up to and including its ';', stopping early at the '}' or end of input
+// ending the list
+void skip_statement(CompilerContext* ctx)
+{
+    for (;;)
     {
-        Node* stmt = parse_stmt();
-        if (!stmt)
+        enum TokenType type = peek_token(ctx, 0)->type;
+        if (type == TOK_RBRACE || type == TOK_EOF)
         {
-            fprintf(stderr, "Error: Failed to parse statement at position %zu\n", token_pos);
-            exit(1);
+            return;
         }
-        if (prev)
+        advance_token(ctx);
+        if (type == TOK_SEMICOLON)
         {
-            prev->next = stmt;
+            return;
         }
-        else
+    }
+}
+
+// Panic mode between functions: drop the tokens up to and including the '}'
+// that most likely ends the function in error
+void skip_function(CompilerContext* ctx)
+{
+    for (;;)
+    {
+        enum TokenType type = peek_token(ctx, 0)->type;
+        if (type == TOK_EOF)
+        {
+            return;
+        }
+        advance_token(ctx);
+        if (type == TOK_RBRACE)
         {
-            list->next = stmt;
+            return;
         }
-        prev = stmt;
     }
-
-    Node* result = list->next;
-    free(list); // Free the dummy list node
-    return result;
 }
 
-Node* parse_stmt()
+// The parser does not recurse: the program and each statement list are loops,
+// and the statements of a list wait on ast.pending, the explicit stack that
+// nested lists are to push onto. Its stack use is the same for every input.
+// Syntax errors are reported and parsing goes on after them, so that one run
+// finds them all.
+void parse_program(CompilerContext* ctx)
 {
-    if (token_pos >= token_count)
+    size_t range_count = ctx->options.threads > 1 && !ctx->token_stream ? ctx->token_count / PARSE_RANGE_MIN_TOKENS : 0;
+    if (range_count > 1)
     {
-        fprintf(stderr, "Error: Unexpected end of input at position %zu\n", token_pos);
-        exit(1);
+        parse_parallel(ctx, range_count < (size_t)ctx->options.threads ? range_count : (size_t)ctx->options.threads);
+        return;
     }
+    parse_functions(ctx, SIZE_MAX);
+}
 
-    Node* stmt;
-    if (tokens[token_pos].type == TOK_RETURN)
+// Parse the functions from the current token up to token end or the end of
+// input
+void parse_functions(CompilerContext* ctx, size_t end)
+{
+    jmp_buf recover;
+    ctx->recover = &recover;
+    if (setjmp(recover) != 0)
     {
-        stmt = parse_return();
+        skip_function(ctx);
     }
-    else if (tokens[token_pos].type == TOK_INT)
+    while (ctx->token_pos < end && peek_token(ctx, 0)->type != TOK_EOF)
     {
-        stmt = parse_var_decl();
+        parse_function(ctx);
     }
-    else if (tokens[token_pos].type == TOK_IDENTIFIER)
+    ctx->recover = NULL;
+}
+
+// Parse ranges of the tokens concurrently and link their functions into the
+// program in order. Whatever it recovers from, the parser gets back to the top
+// level right after each '}': a statement list ends at the first '}' it
+// reaches, and recovery between functions drops tokens up to the next one.
+// Ranges ending after a '}' therefore parse, errors and all, exactly as they
+// would within the whole program.
+void parse_parallel(CompilerContext* ctx, size_t range_count)
+{
+    if (range_count > ctx->parse_range_capacity)
     {
-        // Peek ahead to distinguish assignment from function call
-        if (token_pos + 1 < token_count && tokens[token_pos + 1].type == TOK_EQUAL)
-        {
-            stmt = parse_var_assign();
-        }
-        else
+        ParseRange* ranges = (ParseRange*)realloc(ctx->parse_ranges, range_count * sizeof(ParseRange));
+        if (!ranges)
         {
-            stmt = parse_call();
+            fail(&ctx->errors, "Memory allocation failed for parser ranges");
         }
+        memset(ranges + ctx->parse_range_capacity, 0, (range_count - ctx->parse_range_capacity) * sizeof(ParseRange));
+        ctx->parse_ranges = ranges;
+        ctx->parse_range_capacity = range_count;
     }
-    else
+    ParseRange* ranges = ctx->parse_ranges;
+    size_t start = ctx->token_pos;
+    for (size_t r = 0; r < range_count; r++)
     {
-        fprintf(stderr, "Error: Expected statement at position %zu, got token type %d\n", token_pos, tokens[token_pos].type);
-        exit(1);
+        ParseRange* range = &ranges[r];
+        CompilerContext* parser = &range->parser;
+        size_t end = start + (ctx->token_count - start) / (range_count - r);
+        range->end = r + 1 < range_count ? parse_boundary(ctx, end) : SIZE_MAX;
+        parser->options = ctx->options;
+        parser->input = ctx->input;
+        parser->input_size = ctx->input_size;
+        parser->tokens = ctx->tokens;
+        parser->token_count = ctx->token_count;
+        parser->token_pos = start;
+        parser->fragments = ctx->fragments;
+        reset_ast(&parser->ast);
+        parser->ast.errors = &parser->errors;
+        parser->diagnostics.length = 0;
+        parser->diagnostics.count = 0;
+        parser->diagnostics.line_count = 0;
+        parser->diagnostics.input = ctx->diagnostics.input;
+        parser->trace.count = 0;
+        range->failed = 0;
+        start = range->end;
     }
-    expect(TOK_SEMICOLON);
-    return stmt;
-}
-
-
-Node* parse_return()
-{
-    expect(TOK_RETURN);
-    Node* node = (Node*)malloc(sizeof(Node));
-    node->type = NODE_RETURN;
-    node->next = NULL;
+    ctx->stats.phases[PHASE_PARSE].cpu_ns += run_workers(ranges, sizeof(ParseRange), range_count, parse_range);
 
-    if (tokens[token_pos].type == TOK_NUMBER)
+    // Errors are reported in source order, up to where a serial run would
+    // have given up
+    Ast* ast = &ctx->ast;
+    size_t node_count = ast->node_count;
+    size_t function_count = ast->function_count;
+    for (size_t r = 0; r < range_count; r++)
     {
-        node->left = parse_number();
+        ParseRange* range = &ranges[r];
+        append_trace(&ctx->trace, &range->parser.trace);
+        append_diagnostics(&ctx->diagnostics, &range->parser.diagnostics, DIAGNOSTICS_MAX);
+        if (ctx->diagnostics.count >= DIAGNOSTICS_MAX)
+        {
+            fail(&ctx->errors, "Too many errors, giving up");
+        }
+        if (range->failed)
+        {
+            fail(&ctx->errors, "%s", range->parser.errors.message);
+        }
+        range->program = ast;
+        range->node_base = node_count;
+        range->function_base = function_count;
+        node_count += range->parser.ast.node_count;
+        function_count += range->parser.ast.function_count;
     }
-    else if (tokens[token_pos].type == TOK_IDENTIFIER)
+    if (node_count >= NODE_NONE)
     {
-        if (token_pos < token_count && tokens[token_pos].type == TOK_IDENTIFIER &&
-            token_pos + 1 < token_count && tokens[token_pos + 1].type == TOK_LPAREN)
+        fail(&ctx->errors, "Too many AST nodes");
+    }
+    if (node_count > ast->node_capacity)
+    {
+        Node* nodes = (Node*)realloc(ast->nodes, node_count * sizeof(Node));
+        if (!nodes)
         {
-            node->left = parse_call();
+            fail(&ctx->errors, "Memory allocation failed for AST nodes");
         }
-        else
+        ast->nodes = nodes;
+        ast->node_capacity = node_count;
+    }
+    if (function_count > ast->function_capacity)
+    {
+        Function* functions = (Function*)realloc(ast->functions, function_count * sizeof(Function));
+        if (!functions)
         {
-            node->left = parse_var_ref();
+            fail(&ctx->errors, "Memory allocation failed for functions");
         }
+        ast->functions = functions;
+        ast->function_capacity = function_count;
     }
-    else
+    ctx->stats.phases[PHASE_PARSE].cpu_ns += run_workers(ranges, sizeof(ParseRange), range_count, link_range);
+    ast->node_count = node_count;
+    ast->function_count = function_count;
+    ctx->token_pos = ctx->token_count - 1;
+}
+
+// Index just past the first '}' at or after token from, or of the TOK_EOF
+size_t parse_boundary(const CompilerContext* ctx, size_t from)
+{
+    while (from + 1 < ctx->token_count && ctx->tokens[from].type != TOK_RBRACE)
     {
-        fprintf(stderr, "Error: Expected number, variable or function call at position %zu\n", token_pos);
-        exit(1);
+        from++;
     }
-    return node;
+    return from + 1 < ctx->token_count ? from + 1 : ctx->token_count - 1;
 }
 
-Node* parse_call()
+void* parse_range(void* arg)
 {
-    Node* node = (Node*)malloc(sizeof(Node));
-    if (!node)
+    ParseRange* range = (ParseRange*)arg;
+    CompilerContext* parser = &range->parser;
+    uint64_t start_ns = clock_ns(CLOCK_MONOTONIC);
+    uint64_t start_cpu = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+    if (setjmp(parser->errors.jump) == 0)
     {
-        fprintf(stderr, "Error: Memory allocation failed for call node\n");
-        exit(1);
+        parse_functions(parser, range->end);
     }
-    node->type = NODE_CALL;
-    node->next = NULL;
-    node->left = NULL;
-    node->right = NULL;
-    if (tokens[token_pos].type != TOK_IDENTIFIER)
+    else
     {
-        fprintf(stderr, "Error: Expected identifier for function call at position %zu\n", token_pos);
-        exit(1);
+        range->failed = 1;
     }
-    node->func_name = strdup(tokens[token_pos].value);
-    if (!node->func_name)
+    if (parser->options.trace)
     {
-        fprintf(stderr, "Error: Memory allocation failed for function name\n");
-        exit(1);
+        parser->trace.thread = current_thread_id();
+        trace_event(&parser->trace, "parse range", "range", start_ns, clock_ns(CLOCK_MONOTONIC), 0);
     }
-    expect(TOK_IDENTIFIER);
-    expect(TOK_LPAREN);
-    expect(TOK_RPAREN); // Supporting parameterless call only
-
-    return node;
-}
-
-Node* parse_number()
-{
-    Node* node = malloc(sizeof(Node));
-    node->type = NODE_NUMBER;
-    node->value = atoi(tokens[token_pos].value);
-    node->left = NULL;
-    node->right = NULL;
-    node->next = NULL;
-    expect(TOK_NUMBER);
-    return node;
+    range->worker.cpu_ns = clock_ns(CLOCK_THREAD_CPUTIME_ID) - start_cpu;
+    return NULL;
 }
 
-Node* parse_var_decl()
+// Copy the range's nodes and functions to their place in the program, with
+// the node indices they hold rebased
+void* link_range(void* arg)
 {
-    expect(TOK_INT);
-    Node* node = (Node*)malloc(sizeof(Node));
-    if (!node)
+    ParseRange* range = (ParseRange*)arg;
+    const Ast* ast = &range->parser.ast;
+    uint64_t start_cpu = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+    uint32_t base = (uint32_t)range->node_base;
+    Node* nodes = range->program->nodes + range->node_base;
+    for (size_t i = 0; i < ast->node_count; i++)
     {
-        fprintf(stderr, "Error: Memory allocation failed for variable declaration\n");
-        exit(1);
+        Node node = ast->nodes[i];
+        node.child = node.child != NODE_NONE ? node.child + base : NODE_NONE;
+        nodes[i] = node;
     }
-    node->type = NODE_VAR_DECL;
-    node->next = NULL;
-    node->left = NULL;
-    node->right = NULL;
-
-    if (tokens[token_pos].type != TOK_IDENTIFIER)
+    Function* functions = range->program->functions + range->function_base;
+    for (size_t f = 0; f < ast->function_count; f++)
     {
-        fprintf(stderr, "Error: Expected variable name at position %zu\n", token_pos);
-        exit(1);
+        Function func = ast->functions[f];
+        func.first_stmt += func.fragment == FRAGMENT_NONE ? base : 0;
+        functions[f] = func;
     }
-    node->var_name = strdup(tokens[token_pos].value);
-    expect(TOK_IDENTIFIER);
+    range->worker.cpu_ns = clock_ns(CLOCK_THREAD_CPUTIME_ID) - start_cpu;
+    return NULL;
+}
 
-    // Handle optional initialization
-    if (token_pos < token_count && tokens[token_pos].type == TOK_EQUAL)
+void free_parse_range(ParseRange* range)
+{
+    free(range->parser.ast.nodes);
+    free(range->parser.ast.functions);
+    free(range->parser.ast.pending);
+    free(range->parser.trace.events);
+    free(range->parser.diagnostics.text);
+    free(range->parser.diagnostics.lines);
+}
+
+void parse_function(CompilerContext* ctx)
+{
+    Function func = {0, NAME_NONE, 0, 0, FRAGMENT_NONE, node_offset(peek_token(ctx, 0)->start)};
+    if (ctx->fragments.enabled)
     {
-        expect(TOK_EQUAL);
-        if (tokens[token_pos].type == TOK_NUMBER)
+        size_t end = function_end(ctx);
+        if (end != SIZE_MAX)
         {
-            node->right = parse_number();
-        }
-        else if (tokens[token_pos].type == TOK_IDENTIFIER)
-        {
-            if (token_pos < token_count && tokens[token_pos].type == TOK_IDENTIFIER &&
-                token_pos + 1 < token_count && tokens[token_pos + 1].type == TOK_LPAREN)
-            {
-                node->right = parse_call();
-            }
-            else
-            {
-                node->right = parse_var_ref();
-            }
+            const Token* first = &ctx->tokens[ctx->token_pos];
+            const Token* last = &ctx->tokens[end];
+            func.fingerprint = hash_bytes(ctx->input + first->start, last->start + last->length - first->start, ctx->fragments.seed);
+            func.fragment = find_fragment(&ctx->fragments, func.fingerprint);
         }
-        else
+        if (func.fragment != FRAGMENT_NONE)
         {
-            fprintf(stderr, "Error: Expected number, variable or function call at position %zu\n", token_pos);
-            exit(1);
+            // Unchanged since it was compiled, so there is no need to parse it
+            func.name = ctx->tokens[ctx->token_pos + 1].name;
+            ctx->token_pos = end + 1;
+            add_function(ctx, func);
+            return;
         }
     }
 
-    return node;
+    expect(ctx, TOK_INT);
+
+    if (peek_token(ctx, 0)->type != TOK_IDENTIFIER)
+    {
+        syntax_error(ctx, "function name");
+    }
+    func.name = peek_token(ctx, 0)->name;
+    expect(ctx, TOK_IDENTIFIER);
+
+    expect(ctx, TOK_LPAREN);
+    expect(ctx, TOK_RPAREN); // For now, supporting functions without parameters
+    expect(ctx, TOK_LBRACE);
+    parse_stmt_list(ctx, &func.first_stmt, &func.stmt_count);
+    expect(ctx, TOK_RBRACE);
+    add_function(ctx, func);
+}
+
+void add_function(CompilerContext* ctx, Function func)
+{
+    if (ctx->ast.function_count == ctx->ast.function_capacity)
+    {
+        ctx->ast.functions = (Function*)grow_array(&ctx->errors, ctx->ast.functions, &ctx->ast.function_capacity, sizeof(Function));
+    }
+    ctx->ast.functions[ctx->ast.function_count++] = func;
 }
 
-Node* parse_var_assign()
+// Statements collect on the pending stack while their operands are appended to
+// ast.nodes, then move to ast.nodes as one contiguous range when the list ends.
+// A statement in error is left out, and its operands already appended are
+// never referred to.
+void parse_stmt_list(CompilerContext* ctx, uint32_t* first, uint32_t* count)
 {
-    Node* node = (Node*)malloc(sizeof(Node));
-    if (!node)
+    size_t base = ctx->ast.pending_count;
+    jmp_buf recover;
+    jmp_buf* outer = ctx->recover;
+    ctx->recover = &recover;
+    if (setjmp(recover) != 0)
+    {
+        skip_statement(ctx);
+    }
+    // Running out of input is left to the function's missing '}'
+    for (enum TokenType type; (type = peek_token(ctx, 0)->type) != TOK_RBRACE && type != TOK_EOF;)
     {
-        fprintf(stderr, "Error: Memory allocation failed for variable assignment\n");
-        exit(1);
+        push_pending(&ctx->ast, parse_stmt(ctx));
     }
-    node->type = NODE_VAR_ASSIGN;
-    node->next = NULL;
-    node->left = NULL;
+    ctx->recover = outer;
 
-    if (tokens[token_pos].type != TOK_IDENTIFIER)
+    *count = (uint32_t)(ctx->ast.pending_count - base);
+    *first = (uint32_t)ctx->ast.node_count;
+    for (size_t i = base; i < ctx->ast.pending_count; i++)
     {
-        fprintf(stderr, "Error: Expected variable name at position %zu\n", token_pos);
-        exit(1);
+        add_node(&ctx->ast, ctx->ast.pending[i]);
     }
-    node->var_name = strdup(tokens[token_pos].value);
-    expect(TOK_IDENTIFIER);
-    expect(TOK_EQUAL);
+    ctx->ast.pending_count = base;
+}
 
-    if (tokens[token_pos].type == TOK_NUMBER)
+Node parse_stmt(CompilerContext* ctx)
+{
+    Node stmt;
+    if (peek_token(ctx, 0)->type == TOK_RETURN)
     {
-        node->right = parse_number();
+        stmt = parse_return(ctx);
     }
-    else if (tokens[token_pos].type == TOK_IDENTIFIER)
+    else if (peek_token(ctx, 0)->type == TOK_INT)
     {
-        // Peek ahead to distinguish variable reference from function call
-        if (token_pos < token_count && tokens[token_pos].type == TOK_IDENTIFIER &&
-            token_pos + 1 < token_count && tokens[token_pos + 1].type == TOK_LPAREN)
+        stmt = parse_var_decl(ctx);
+    }
+    else if (peek_token(ctx, 0)->type == TOK_IDENTIFIER)
+    {
+        // Peek ahead to distinguish assignment from function call
+        if (peek_token(ctx, 1)->type == TOK_EQUAL)
         {
-            node->right = parse_call();
+            stmt = parse_var_assign(ctx);
         }
         else
         {
-            node->right = parse_var_ref();
+            stmt = parse_call(ctx);
         }
     }
     else
     {
-        fprintf(stderr, "Error: Expected number, variable or function call at position %zu\n", token_pos);
-        exit(1);
+        syntax_error(ctx, "statement");
     }
-    return node;
+    expect(ctx, TOK_SEMICOLON);
+    return stmt;
 }
 
-Node* parse_var_ref()
+// Operand of a return, initialization or assignment, appended to ast.nodes
+uint32_t parse_expr(CompilerContext* ctx)
 {
-    Node* node = (Node*)malloc(sizeof(Node));
-    if (!node)
+    if (peek_token(ctx, 0)->type == TOK_NUMBER)
     {
-        fprintf(stderr, "Error: Memory allocation failed for variable reference\n");
-        exit(1);
+        return add_node(&ctx->ast, parse_number(ctx));
     }
-    node->type = NODE_VAR_REF;
-    node->next = NULL;
-    node->left = NULL;
-    node->right = NULL;
-
-    if (tokens[token_pos].type != TOK_IDENTIFIER)
+    else if (peek_token(ctx, 0)->type == TOK_IDENTIFIER)
     {
-        fprintf(stderr, "Error: Expected variable name at position %zu\n", token_pos);
-        exit(1);
+        // Peek ahead to distinguish variable reference from function call
+        if (peek_token(ctx, 1)->type == TOK_LPAREN)
+        {
+            return add_node(&ctx->ast, parse_call(ctx));
+        }
+        return add_node(&ctx->ast, parse_var_ref(ctx));
     }
-    node->var_name = strdup(tokens[token_pos].value);
-    expect(TOK_IDENTIFIER);;
-    return node;
+    syntax_error(ctx, "number, variable or function call");
 }
 
-void free_ast(Node* node)
+Node parse_return(CompilerContext* ctx)
 {
-    if (!node) return;
+    Node node = {.type = NODE_RETURN, .offset = node_offset(peek_token(ctx, 0)->start)};
+    expect(ctx, TOK_RETURN);
+    node.child = parse_expr(ctx);
+    return node;
+}
 
-    if (node->type == NODE_PROGRAM || node->type == NODE_FUNCTION)
+Node parse_call(CompilerContext* ctx)
+{
+    Node node = {.type = NODE_CALL, .child = NODE_NONE, .offset = node_offset(peek_token(ctx, 0)->start)};
+    if (peek_token(ctx, 0)->type != TOK_IDENTIFIER)
     {
-        free_ast(node->next);
-        if (node->type == NODE_FUNCTION)
-        {
-            free(node->func_name);
-            free_ast(node->body);
-        }
+        syntax_error(ctx, "function name");
     }
-    else if (node->type == NODE_RETURN)
+    node.name = peek_token(ctx, 0)->name;
+    expect(ctx, TOK_IDENTIFIER);
+    expect(ctx, TOK_LPAREN);
+    expect(ctx, TOK_RPAREN); // Supporting parameterless call only
+
+    return node;
+}
+
+Node parse_number(CompilerContext* ctx)
+{
+    Node node = {.type = NODE_NUMBER, .child = NODE_NONE, .offset = node_offset(peek_token(ctx, 0)->start)};
+    node.value = token_number(ctx, peek_token(ctx, 0));
+    expect(ctx, TOK_NUMBER);
+    return node;
+}
+
+Node parse_var_decl(CompilerContext* ctx)
+{
+    Node node = {.type = NODE_VAR_DECL, .child = NODE_NONE, .offset = node_offset(peek_token(ctx, 0)->start)};
+    expect(ctx, TOK_INT);
+
+    if (peek_token(ctx, 0)->type != TOK_IDENTIFIER)
     {
-        free_ast(node->left);
-        free_ast(node->next);
+        syntax_error(ctx, "variable name");
     }
-    else if (node->type == NODE_CALL)
+    node.name = peek_token(ctx, 0)->name;
+    expect(ctx, TOK_IDENTIFIER);
+
+    // Handle optional initialization
+    if (peek_token(ctx, 0)->type == TOK_EQUAL)
     {
-        if (node->func_name)
-        {
-            free(node->func_name);
-        }
-        free_ast(node->next);
+        expect(ctx, TOK_EQUAL);
+        node.child = parse_expr(ctx);
     }
-    else if (node->type == NODE_VAR_DECL || node->type == NODE_VAR_REF)
+
+    return node;
+}
+
+Node parse_var_assign(CompilerContext* ctx)
+{
+    Node node = {.type = NODE_VAR_ASSIGN, .offset = node_offset(peek_token(ctx, 0)->start)};
+
+    if (peek_token(ctx, 0)->type != TOK_IDENTIFIER)
     {
-        if (node->var_name)
-        {
-            free(node->var_name);
-        }
-        free(node->next);
+        syntax_error(ctx, "variable name");
     }
-    else if (node->type == NODE_VAR_ASSIGN)
+    node.name = peek_token(ctx, 0)->name;
+    expect(ctx, TOK_IDENTIFIER);
+    expect(ctx, TOK_EQUAL);
+    node.child = parse_expr(ctx);
+    return node;
+}
+
+Node parse_var_ref(CompilerContext* ctx)
+{
+    Node node = {.type = NODE_VAR_REF, .child = NODE_NONE, .offset = node_offset(peek_token(ctx, 0)->start)};
+
+    if (peek_token(ctx, 0)->type != TOK_IDENTIFIER)
     {
-        if (node->var_name)
-        {
-            free(node->var_name);
-        }
-        free_ast(node->right);
-        free_ast(node->next);
+        syntax_error(ctx, "variable name");
     }
-    free(node);
+    node.name = peek_token(ctx, 0)->name;
+    expect(ctx, TOK_IDENTIFIER);
+    return node;
 }